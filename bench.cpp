@@ -0,0 +1,356 @@
+#include "hdrs/echo.hpp"
+#include <random>
+#include <cstdlib>
+#include <cstddef>
+#include <sys/resource.h>
+
+// Microbenchmarks of the echolang interpreter.
+//   bench [filter]
+// Scripts come from fixed seed generators (raw mt19937 output only, so the
+// same rows are produced by every standard library), results of different
+// versions can be compared line by line.
+
+namespace {
+    std::atomic<size_t> Allocations{0};
+    std::atomic<size_t> Live{0};
+    std::atomic<size_t> Peak{0};
+
+    // Every block starts with its requested size, padded so the returned
+    // pointer keeps the alignment malloc guarantees.
+    constexpr size_t Header = alignof(std::max_align_t);
+
+    void* Allocate(size_t size) {
+        auto block = static_cast<char*>(std::malloc(Header + size));
+        if (block == nullptr)
+            throw std::bad_alloc{};
+        *reinterpret_cast<size_t*>(block) = size;
+
+        Allocations.fetch_add(1, std::memory_order_relaxed);
+        auto live = Live.fetch_add(size, std::memory_order_relaxed) + size;
+        for (auto peak = Peak.load(std::memory_order_relaxed); live > peak && !Peak.compare_exchange_weak(peak, live););
+        return block + Header;
+    }
+
+    void Release(void* ptr) {
+        if (ptr == nullptr)
+            return;
+        auto block = static_cast<char*>(ptr) - Header;
+        Live.fetch_sub(*reinterpret_cast<size_t*>(block), std::memory_order_relaxed);
+        std::free(block);
+    }
+}
+
+void* operator new(size_t size) { return Allocate(size); }
+void* operator new[](size_t size) { return Allocate(size); }
+void operator delete(void* ptr) noexcept { Release(ptr); }
+void operator delete[](void* ptr) noexcept { Release(ptr); }
+void operator delete(void* ptr, size_t) noexcept { Release(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { Release(ptr); }
+
+namespace bench {
+
+using namespace echolang;
+
+struct Case {
+    std::string name;
+    std::function<size_t()> run;
+};
+
+struct Generator {
+    std::mt19937 rng;
+
+    Generator(uint32_t seed) : rng(seed) {}
+
+    size_t next(size_t bound) {
+        return rng() % bound;
+    }
+
+    std::string word() {
+        static const char* words[] = {"Name", "Tags", "Sorter", "Namer", "Ranges", "echo", "Expr", "InnerSelector"};
+        return words[next(std::size(words))];
+    }
+
+    std::string path(size_t parts) {
+        std::string res = word();
+        for (size_t i = 1; i < parts; i++)
+            res += '/' + word();
+        return res;
+    }
+
+    // Rows at a random depth below `depth`, never more than one level deeper
+    // than the row before.
+    std::string script(size_t rows, size_t depth) {
+        std::string res;
+        size_t space = 0;
+        for (size_t i = 0; i < rows; i++) {
+            space = std::min(next(space + 2), depth - 1);
+            res += std::string(space, ' ') + '[' + path(1 + next(3));
+            if (next(2))
+                res += '$' + std::to_string(rng());
+            res += "]\n";
+        }
+        return res;
+    }
+};
+
+std::string TempPath(const std::string& name) {
+    return "/tmp/echo-bench-" + std::to_string(::getpid()) + '-' + name + ".emerald";
+}
+
+void WriteFile(const std::string& path, const std::string& text) {
+    std::ofstream out{path};
+    out << text;
+}
+
+echo_func Nop() {
+    return [](echo_row row) { return false; };
+}
+
+echo_func Enter() {
+    return echo_single_shot{[](echo_row row) { return true; }};
+}
+
+std::shared_ptr<const echo_script> Parse(const std::string& text) {
+    auto script = std::make_shared<echo_script>();
+    script->from_row(text);
+    return script;
+}
+
+size_t Execute(std::shared_ptr<const echo_script> script, const echo_func& mapping) {
+    size_t rows = 0;
+    executor exec{script, [&](echo_row row) { rows++; return mapping(row); }};
+    exec.run();
+    return rows;
+}
+
+std::vector<Case> Lexing() {
+    std::vector<Case> res;
+    for (size_t rows : {1000, 10000, 100000}) {
+        auto text = Generator{1}.script(rows, 8);
+        res.push_back({"lex/from_row/rows=" + std::to_string(rows), [text, rows] {
+            echo_script script;
+            script.from_row(text);
+            return rows;
+        }});
+    }
+    for (size_t depth : {1, 16, 64}) {
+        auto text = Generator{2}.script(10000, depth);
+        res.push_back({"lex/from_row/depth=" + std::to_string(depth), [text] {
+            echo_script script;
+            script.from_row(text);
+            return script.size();
+        }});
+    }
+
+    auto source = TempPath("source");
+    auto compiled = TempPath("compiled");
+    auto text = Generator{3}.script(10000, 8);
+    WriteFile(source, text);
+    WriteFile(compiled, text);
+    echo_script::compile_file(compiled);
+
+    res.push_back({"lex/from_file/source", [source] {
+        echo_script script;
+        script.from_file(source);
+        return script.size();
+    }});
+    res.push_back({"lex/from_file/compiled", [compiled] {
+        echo_script script;
+        script.from_file(compiled);
+        return script.size();
+    }});
+    return res;
+}
+
+std::vector<Case> Dispatch() {
+    std::vector<Case> res;
+    for (size_t depth : {1, 4, 16}) {
+        echo_mapping leaf;
+        leaf.mappings["leaf"] = Nop();
+        std::string name = "leaf";
+        for (size_t i = 0; i < depth; i++) {
+            echo_mapping level;
+            for (auto other : {"a", "b", "c", "d", "e", "f", "g"})
+                level.mappings[other] = Nop();
+            level.mappings["level"] = leaf;
+            leaf = level;
+            name = "level/" + name;
+        }
+
+        res.push_back({"dispatch/path/depth=" + std::to_string(depth), [leaf, name] {
+            constexpr size_t calls = 100000;
+            echo_row row{name, "value"};
+            for (size_t i = 0; i < calls; i++)
+                leaf(row);
+            return calls;
+        }});
+    }
+    return res;
+}
+
+// `depth` entered rows, each with its own single shot; every level also holds
+// `width` false rows whose subtrees of `subtree` nested rows are skipped.
+std::string FalseBranches(size_t depth, size_t width, size_t subtree) {
+    std::string res;
+    for (size_t d = 0; d < depth; d++) {
+        for (size_t w = 0; w < width; w++) {
+            res += std::string(d, ' ') + "[skip]\n";
+            for (size_t s = 0; s < subtree; s++)
+                res += std::string(d + 1 + s, ' ') + "[nop]\n";
+        }
+        res += std::string(d, ' ') + "[enter/" + std::to_string(d) + "]\n";
+    }
+    return res;
+}
+
+std::vector<Case> Execution() {
+    std::vector<Case> res;
+
+    auto controls = std::make_shared<echo_mapping>(echo_mapping::create_default_controls());
+    controls->mappings["nop"] = Nop();
+    controls->mappings["skip"] = Nop();
+    echo_mapping enter;
+    for (size_t d = 0; d < 64; d++)
+        enter.mappings[std::to_string(d)] = Enter();
+    controls->mappings["enter"] = enter;
+    echo_func mapping = echo_bind_shared(controls);
+
+    for (size_t depth : {4, 64}) {
+        auto script = Parse(FalseBranches(depth, 8, 16));
+        res.push_back({"exec/false_branches/depth=" + std::to_string(depth), [script, mapping] {
+            Execute(script, mapping);
+            return script->size();
+        }});
+    }
+
+    for (size_t body : {1, 16}) {
+        std::string text = "[echo/cycle$10000]\n";
+        for (size_t i = 0; i < body; i++)
+            text += " [nop]\n";
+        auto script = Parse(text);
+        res.push_back({"exec/cycle/body=" + std::to_string(body), [script, mapping] {
+            return Execute(script, mapping);
+        }});
+    }
+    return res;
+}
+
+struct Object {
+    std::string name;
+    bool flag{false};
+
+    void init_mappings(echo_mapping* map) {
+        map->mappings["name"] = echo_field{name};
+        map->mappings["flag"] = echo_flag_field{flag};
+    }
+};
+
+std::vector<Case> Objects() {
+    std::vector<Case> res;
+
+    auto ptr = std::make_shared<Object*>(nullptr);
+    echo_object<Object> object{*ptr};
+    object.inits["basic"] = [] { return new Object{}; };
+
+    echo_mapping objects;
+    objects.mappings["Object"] = object;
+    auto script = Parse("[Object$basic]\n [Object/name/set$value]\n [Object/flag/set]\n");
+
+    res.push_back({"object/init", [ptr, objects, script] {
+        constexpr size_t runs = 1000;
+        size_t rows = 0;
+        for (size_t i = 0; i < runs; i++) {
+            rows += Execute(script, objects);
+            delete *ptr;
+            *ptr = nullptr;
+        }
+        return rows;
+    }});
+
+    for (size_t keys : {16, 1024}) {
+        Generator gen{4};
+        std::string text;
+        for (size_t i = 0; i < 4096; i++) {
+            auto key = "k" + std::to_string(gen.next(keys));
+            switch (gen.next(3)) {
+                case 0:
+                    text += "[Map$add/" + key + "]\n";
+                    break;
+                case 1:
+                    text += "[Map/" + key + "/set$" + std::to_string(gen.rng()) + "]\n";
+                    break;
+                default:
+                    text += "[Map$remove/" + key + "]\n";
+            }
+        }
+        auto script = Parse(text);
+
+        res.push_back({"generic/map/keys=" + std::to_string(keys), [script] {
+            std::map<std::string, std::string> values;
+            echo_mapping map;
+            map.mappings["Map"] = generic::create_echo_generic_map<std::string>(values, generic::echo_generic_field{});
+            return Execute(script, map);
+        }});
+    }
+    return res;
+}
+
+void Report(const Case& c) {
+    using clock = std::chrono::steady_clock;
+
+    c.run();
+
+    auto allocations = Allocations.load();
+    auto base = Live.load();
+    Peak = base;
+    auto begin = clock::now();
+    size_t rows = c.run();
+    double best = std::chrono::duration<double, std::nano>(clock::now() - begin).count();
+    allocations = Allocations.load() - allocations;
+    size_t peak = Peak.load() - base;
+
+    auto deadline = clock::now() + std::chrono::milliseconds{200};
+    for (int i = 0; i < 2 || clock::now() < deadline; i++) {
+        auto start = clock::now();
+        c.run();
+        best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start).count());
+    }
+
+    rows = std::max<size_t>(rows, 1);
+    std::cout << std::left << std::setw(36) << c.name << std::right
+        << std::setw(10) << rows
+        << std::setw(12) << std::fixed << std::setprecision(1) << best / rows
+        << std::setw(12) << std::setprecision(2) << double(allocations) / rows
+        << std::setw(12) << peak / 1024 << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter = argc > 1 ? argv[1] : "";
+
+    std::vector<bench::Case> cases;
+    for (auto group : {bench::Lexing, bench::Dispatch, bench::Execution, bench::Objects}) {
+        auto part = group();
+        cases.insert(cases.end(), part.begin(), part.end());
+    }
+
+    std::cout << std::left << std::setw(36) << "benchmark" << std::right
+        << std::setw(10) << "rows"
+        << std::setw(12) << "ns/row"
+        << std::setw(12) << "allocs/row"
+        << std::setw(12) << "peak KiB" << std::endl;
+
+    for (auto& c : cases) {
+        if (c.name.find(filter) != std::string::npos)
+            bench::Report(c);
+    }
+
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Max resident: " << usage.ru_maxrss << " KiB" << std::endl;
+
+    std::remove(bench::TempPath("source").c_str());
+    std::remove(bench::TempPath("compiled").c_str());
+    std::remove((bench::TempPath("compiled") + echolang::echo_script::compiled_suffix).c_str());
+}
@@ -7,11 +7,26 @@
 #include <map>
 #include <set>
 #include <stack>
+#include <deque>
 #include <string>
+#include <string_view>
 #include <fstream>
 #include <sstream>
 #include <memory>
 #include <functional>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define echo_lambda(catch) [catch](echolang::echo_row row)
 
@@ -33,12 +48,135 @@ struct echo_row {
     echo_row(std::string name, std::string value, int space) : name(name), value(value), space(space) {}
 };
 
+// Compiled script layout (.emeraldc):
+//   echo_image_header | echo_image_row[rows] | string blob
+// All references are offsets from the start of the file, so the image can be
+// mapped at any address and read in place.
+struct echo_image_header {
+    constexpr const static char magic_value[4] = {'E', 'C', 'H', 'C'};
+    constexpr const static uint32_t current_version = 2;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t rows;
+    uint32_t strings;
+    int64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+};
+
+struct echo_image_row {
+    uint32_t name;
+    uint32_t name_size;
+    uint32_t value;
+    uint32_t value_size;
+    int32_t space;
+    int32_t next;
+};
+
+class echo_image {
+private:
+    void* map_{MAP_FAILED};
+    size_t size_{0};
+
+    const echo_image_header& header() const {
+        return *static_cast<const echo_image_header*>(map_);
+    }
+
+    const echo_image_row* rows() const {
+        return reinterpret_cast<const echo_image_row*>(static_cast<const char*>(map_) + sizeof(echo_image_header));
+    }
+
+    const char* strings() const {
+        return reinterpret_cast<const char*>(rows() + header().rows);
+    }
+
+    bool validate() const {
+        if (size_ < sizeof(echo_image_header))
+            return false;
+        auto& h = header();
+        if (std::memcmp(h.magic, echo_image_header::magic_value, 4) != 0 || h.version != echo_image_header::current_version)
+            return false;
+        if (size_ != sizeof(echo_image_header) + size_t(h.rows) * sizeof(echo_image_row) + h.strings)
+            return false;
+        for (size_t i = 0; i < h.rows; i++) {
+            auto& r = rows()[i];
+            if (size_t(r.name) + r.name_size > h.strings || size_t(r.value) + r.value_size > h.strings)
+                return false;
+            if (r.next != -1 && (r.next <= int64_t(i) || r.next >= int64_t(h.rows)))
+                return false;
+        }
+        return true;
+    }
+
+public:
+    echo_image(const echo_image&) = delete;
+    echo_image& operator=(const echo_image&) = delete;
+
+    echo_image(std::string path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            size_ = st.st_size;
+            map_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+
+        if (map_ != MAP_FAILED && !validate()) {
+            ::munmap(map_, size_);
+            map_ = MAP_FAILED;
+        }
+    }
+
+    ~echo_image() {
+        if (map_ != MAP_FAILED)
+            ::munmap(map_, size_);
+    }
+
+    bool valid() const {
+        return map_ != MAP_FAILED;
+    }
+
+    int64_t source_size() const {
+        return header().source_size;
+    }
+
+    int64_t source_mtime() const {
+        return header().source_mtime;
+    }
+
+    uint64_t source_hash() const {
+        return header().source_hash;
+    }
+
+    size_t size() const {
+        return header().rows;
+    }
+
+    std::string_view name(size_t i) const {
+        return {strings() + rows()[i].name, rows()[i].name_size};
+    }
+
+    std::string_view value(size_t i) const {
+        return {strings() + rows()[i].value, rows()[i].value_size};
+    }
+
+    int space(size_t i) const {
+        return rows()[i].space;
+    }
+
+    int next(size_t i) const {
+        return rows()[i].next;
+    }
+};
+
 class echo_script {
 private:
     void from_iterateble_structure(auto begin, auto end) {
-        std::regex tag_match("(?:\\n|^)( *)\\[([^$\\]]*)(?:\\$([^\\]]*))?\\]");
-
-        auto tags_begin = std::sregex_iterator(begin, end, tag_match);
+        auto tags_begin = std::sregex_iterator(begin, end, tag_match());
         auto tags_end = std::sregex_iterator();
 
         for (auto i = tags_begin; i != tags_end; i++) {
@@ -47,42 +185,198 @@ private:
         }
     }
 
+    static bool file_stat(const std::string& path, struct stat& st) {
+        return ::stat(path.c_str(), &st) == 0;
+    }
+
+    bool from_compiled(std::string path) {
+        auto img = std::make_shared<echo_image>(path);
+        if (!img->valid())
+            return false;
+        data.clear();
+        image = img;
+        return true;
+    }
+
 public:
+    inline static const std::string compiled_suffix = "c";
+
+    static const std::regex& tag_match() {
+        static const std::regex match("(?:\\n|^)( *)\\[([^$\\]]*)(?:\\$([^\\]]*))?\\]");
+        return match;
+    }
+
     std::vector<echo_row> data;
+    std::shared_ptr<const echo_image> image;
+    std::string source;
 
     echo_script() {}
 
+    size_t size() const {
+        return image ? image->size() : data.size();
+    }
+
+    int space(size_t i) const {
+        return image ? image->space(i) : data[i].space;
+    }
+
+    bool has(size_t i) const {
+        return i < size();
+    }
+
+    size_t first() const {
+        return 0;
+    }
+
+    echo_row row(size_t i) const {
+        if (image)
+            return echo_row{std::string{image->name(i)}, std::string{image->value(i)}, image->space(i)};
+        return data[i];
+    }
+
+    int next_same_level(size_t pos) const {
+        if (image)
+            return image->next(pos);
+        int l = data[pos].space;
+        for (size_t i = pos + 1; i < data.size() && data[i].space >= l; i++)
+            if (data[i].space == l)
+                return i;
+        return -1;
+    }
+
     void from_row(std::string row) {
         from_iterateble_structure(row.begin(), row.end());
     }
 
+    // FNV-1a, stable across builds so compiled images stay comparable.
+    static uint64_t content_hash(std::string_view content) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : content)
+            hash = (hash ^ c) * 1099511628211ULL;
+        return hash;
+    }
+
+    static int64_t mtime_ns(const struct stat& st) {
+#ifdef __APPLE__
+        return int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+
+    // The compiled image is used when it was made from a source with the same
+    // size and modification time; otherwise the source is read and the image
+    // is still used if the content hash matches.
     void from_file(std::string path) {
+        source = path;
+        if (!image && data.empty()) {
+            struct stat src;
+            if (file_stat(path, src) && from_compiled(path + compiled_suffix)) {
+                if (image->source_size() == src.st_size && image->source_mtime() == mtime_ns(src))
+                    return;
+                image.reset();
+            }
+        }
+
+        from_content(path, read_file(path));
+    }
+
+    // Rows for `content` read from `path`: the compiled image when its hash
+    // matches, the parsed content otherwise.
+    void from_content(std::string path, const std::string& content) {
+        source = path;
+        image.reset();
+        data.clear();
+        if (from_compiled(path + compiled_suffix)) {
+            if (image->source_size() == int64_t(content.size()) && image->source_hash() == content_hash(content))
+                return;
+            image.reset();
+        }
+        from_iterateble_structure(content.begin(), content.end());
+    }
+
+    void from_source_file(std::string path) {
+        source = path;
+        std::string a = read_file(path);
+        from_iterateble_structure(a.begin(), a.end());
+    }
+
+    static std::string read_file(const std::string& path) {
         std::ifstream file(path);
 
         std::stringstream buffer;
         buffer << file.rdbuf();
 
-        std::string a = buffer.str();
+        return buffer.str();
+    }
+
+    bool to_compiled_file(std::string path, int64_t source_size = -1, int64_t source_mtime = -1, uint64_t source_hash = 0) const {
+        std::vector<echo_image_row> rows;
+        std::string strings;
+        rows.reserve(size());
+        for (size_t i = 0; i < size(); i++) {
+            auto r = row(i);
+            echo_image_row out{};
+            out.name = strings.size();
+            out.name_size = r.name.size();
+            strings += r.name;
+            out.value = strings.size();
+            out.value_size = r.value.size();
+            strings += r.value;
+            out.space = r.space;
+            out.next = next_same_level(i);
+            rows.push_back(out);
+        }
 
-        from_iterateble_structure(a.begin(), a.end());
+        echo_image_header header{};
+        std::memcpy(header.magic, echo_image_header::magic_value, 4);
+        header.version = echo_image_header::current_version;
+        header.rows = rows.size();
+        header.strings = strings.size();
+        header.source_size = source_size;
+        header.source_mtime = source_mtime;
+        header.source_hash = source_hash;
+
+        auto tmp = path + ".tmp";
+        {
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(rows.data()), rows.size() * sizeof(echo_image_row));
+            file.write(strings.data(), strings.size());
+            if (!file)
+                return false;
+        }
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    static bool compile_file(std::string path) {
+        struct stat src;
+        if (!file_stat(path, src))
+            return false;
+        auto content = read_file(path);
+        echo_script script;
+        script.source = path;
+        script.from_iterateble_structure(content.begin(), content.end());
+        return script.to_compiled_file(path + compiled_suffix, content.size(), mtime_ns(src), content_hash(content));
     }
 
     auto extract_group(int begin) {
-        if (data[begin].space <= data[begin + 1].space)
+        if (space(begin) <= space(begin + 1))
             return echo_script{};
         begin++;
 
         echo_script script;
         int end = begin;
-        while(data[end].space >= data[begin].space)
-            script.data.emplace_back(data[end++]);
+        while(space(end) >= space(begin))
+            script.data.emplace_back(row(end++));
         return script;
     }
 
     friend std::ostream& operator<<(std::ostream& out, echo_script& s) {
         std::cout << "Script:\n";
-        for (auto i : s.data) {
-            std::cout << '[' << i.space << ']' << i.name << '{' << i.value << "}\n";
+        for (size_t i = 0; i < s.size(); i++) {
+            auto r = s.row(i);
+            std::cout << '[' << r.space << ']' << r.name << '{' << r.value << "}\n";
         }
         return out;
     }
@@ -90,51 +384,394 @@ public:
     friend class executor;
 };
 
-using echo_func = std::function<bool(echo_row)>;
-
-class executor {
+// Incremental reader for scripts too large to keep in memory. Rows are parsed
+// line by line on demand and dropped once execution is past them. A top-level
+// block whose row is false is read through without being kept. A top-level
+// block that runs stays resident until it is left, because its rows may loop;
+// memory is bounded by the largest executed top-level block.
+class echo_stream {
 private:
-    bool pos_exsists(int pos) {
-        return pos < script->data.size();
+    std::ifstream file_;
+    std::deque<echo_row> rows_;
+    size_t first_{0};
+    bool done_{false};
+
+    void pull() {
+        std::string line, text;
+        while (std::getline(file_, line)) {
+            text = text.empty() ? line : text + '\n' + line;
+
+            std::smatch match;
+            if (std::regex_search(text, match, echo_script::tag_match(), std::regex_constants::match_continuous)) {
+                rows_.emplace_back(match[2], match[3], match[1].length());
+                return;
+            }
+
+            auto open = text.find_first_not_of(' ');
+            if (open == std::string::npos || text[open] != '[' || text.find(']', open) != std::string::npos)
+                text.clear();
+        }
+        done_ = true;
+    }
+
+public:
+    std::string source;
+
+    echo_stream(std::string path) : file_(path), source(path) {}
+
+    bool has(size_t pos) {
+        while (!done_ && pos >= first_ + rows_.size())
+            pull();
+        return pos >= first_ && pos < first_ + rows_.size();
+    }
+
+    echo_row row(size_t pos) {
+        has(pos);
+        return rows_[pos - first_];
+    }
+
+    int space(size_t pos) {
+        has(pos);
+        return rows_[pos - first_].space;
     }
 
-    int next_same_level_pos(int pos) {
-        int l = script->data[pos].space;
-        for (int i = pos + 1; i < script->data.size() && script->data[i].space >= l; i++)
-            if (script->data[i].space == l)
+    size_t first() const {
+        return first_;
+    }
+
+    int next_same_level(size_t pos) {
+        int l = space(pos);
+        for (size_t i = pos + 1; has(i) && space(i) >= l; i++)
+            if (space(i) == l)
                 return i;
         return -1;
     }
 
+    void release(size_t pos) {
+        while (first_ < pos && !rows_.empty()) {
+            rows_.pop_front();
+            first_++;
+        }
+    }
+
+    // Next sibling of a top-level row, dropping the row and its subtree while
+    // reading through them; -1 when the level ends.
+    int skip_block(size_t pos) {
+        int l = space(pos);
+        release(pos + 1);
+        while (has(first_) && space(first_) > l)
+            release(first_ + 1);
+        return has(first_) && space(first_) == l ? first_ : -1;
+    }
+
+    size_t window() const {
+        return rows_.size();
+    }
+};
+
+class echo_script_cache {
+private:
+    struct entry {
+        std::string content;
+        std::string directory;
+        std::shared_ptr<const echo_script> script;
+    };
+
+    inline static std::mutex lock_{};
+    inline static std::multimap<size_t, entry> scripts_{};
+    inline static size_t requests_{0};
+
 public:
-    echo_func echo;
-    std::stack<int> position;
-    std::shared_ptr<echo_script> script;
+    constexpr const static char include_directive[] = "echo/include";
 
-    executor(std::shared_ptr<echo_script> trg, echo_func echo) : script(trg), echo(echo) {}
+    static std::string directory_of(const std::string& path) {
+        auto i = path.find_last_of('/');
+        return i == std::string::npos ? std::string{} : path.substr(0, i + 1);
+    }
 
-    void run(int pos = 0) {
+    // Scripts with include rows resolve them relative to their own folder,
+    // so the folder becomes part of the identity of such scripts.
+    static std::shared_ptr<const echo_script> load(std::string path) {
+        auto content = echo_script::read_file(path);
+        auto directory = content.find(include_directive) == std::string::npos ? std::string{} : directory_of(path);
+        auto key = std::hash<std::string>{}(content) ^ (std::hash<std::string>{}(directory) << 1);
+
+        auto find = [&]() -> std::shared_ptr<const echo_script> {
+            auto range = scripts_.equal_range(key);
+            for (auto i = range.first; i != range.second; i++)
+                if (i->second.content == content && i->second.directory == directory)
+                    return i->second.script;
+            return nullptr;
+        };
+
+        {
+            std::lock_guard guard{lock_};
+            requests_++;
+            if (auto found = find())
+                return found;
+        }
+
+        // Parse outside of the lock so loaders on other threads are not serialized.
+        auto script = std::make_shared<echo_script>();
+        script->from_content(path, content);
+
+        std::lock_guard guard{lock_};
+        if (auto found = find())
+            return found;
+        scripts_.emplace(key, entry{std::move(content), std::move(directory), script});
+        return script;
+    }
+
+    static size_t size() {
+        std::lock_guard guard{lock_};
+        return scripts_.size();
+    }
+
+    static size_t requests() {
+        std::lock_guard guard{lock_};
+        return requests_;
+    }
+
+    static void clear() {
+        std::lock_guard guard{lock_};
+        scripts_.clear();
+        requests_ = 0;
+    }
+};
+
+using echo_func = std::function<bool(echo_row)>;
+
+// Per-execution state. Mapping tables hold only dispatch structure, so one
+// table can be run by many executors at once; anything that changes while a
+// script runs (shot flags, cycle counters, the bound target and the mappings
+// of objects created for it) lives in the frame of the running executor.
+class echo_frame {
+private:
+    inline static std::atomic<size_t> slots_{0};
+
+    std::unordered_map<size_t, size_t> values_;
+    std::map<const void*, echo_func> objects_;
+    void* target_{nullptr};
+
+public:
+    inline static thread_local echo_frame* current{nullptr};
+
+    struct scope {
+        echo_frame* previous;
+
+        scope(echo_frame& frame) : previous(current) { current = &frame; }
+        ~scope() { current = previous; }
+    };
+
+    echo_frame(void* target = nullptr) : target_(target) {}
+
+    static size_t new_slot() {
+        return slots_++;
+    }
+
+    static echo_frame& get() {
+        if (current != nullptr)
+            return *current;
+        thread_local echo_frame detached;
+        return detached;
+    }
+
+    size_t& value(size_t slot, size_t init) {
+        return values_.try_emplace(slot, init).first->second;
+    }
+
+    void* target() const {
+        return target_;
+    }
+
+    template<typename T>
+    T& target() const {
+        return *static_cast<T*>(target_);
+    }
+
+    template<typename T, typename Init>
+    const echo_func& object(const T* obj, Init init) {
+        auto it = objects_.find(obj);
+        if (it == objects_.end())
+            it = objects_.emplace(obj, init()).first;
+        return it->second;
+    }
+};
+
+class echo_profiler {
+public:
+    using clock = std::chrono::steady_clock;
+    using duration = std::chrono::nanoseconds;
+
+    struct record {
+        size_t calls{0};
+        size_t trues{0};
+        duration total{0};
+        duration self{0};
+    };
+
+    // Executors pick up the profiler of their thread when constructed, so
+    // scripts run from inside mappings (includes, unit scripts) nest under
+    // the row that started them.
+    inline static thread_local echo_profiler* current{nullptr};
+
+    struct scope {
+        echo_profiler* previous;
+
+        scope(echo_profiler& profiler) : previous(current) { current = &profiler; }
+        ~scope() { current = previous; }
+    };
+
+    std::map<std::string, record> rows;
+    std::map<std::string, duration> stacks;
+
+    template<typename F>
+    bool measure(const std::string& name, const std::string& frame, F&& func) {
+        frames_.push_back(frames_.empty() ? frame : frames_.back() + ';' + frame);
+        nested_.push_back(duration{0});
+
+        auto begin = clock::now();
+        bool r = func();
+        duration elapsed = clock::now() - begin;
+
+        duration inner = nested_.back();
+        nested_.pop_back();
+        if (!nested_.empty())
+            nested_.back() += elapsed;
+
+        auto& rec = rows[name];
+        rec.calls++;
+        rec.trues += r;
+        rec.total += elapsed;
+        rec.self += elapsed - inner;
+
+        stacks[frames_.back()] += elapsed - inner;
+        frames_.pop_back();
+        return r;
+    }
+
+    void report(std::ostream& out) const {
+        std::vector<std::pair<std::string, record>> sorted(rows.begin(), rows.end());
+        std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.second.self > b.second.self; });
+
+        out << std::setw(12) << "self(us)" << std::setw(12) << "total(us)" << std::setw(10) << "calls"
+            << std::setw(10) << "true" << std::setw(10) << "false" << "  path\n";
+        for (auto& [name, rec] : sorted) {
+            out << std::setw(12) << rec.self.count() / 1000 << std::setw(12) << rec.total.count() / 1000
+                << std::setw(10) << rec.calls << std::setw(10) << rec.trues << std::setw(10) << rec.calls - rec.trues
+                << "  " << name << '\n';
+        }
+    }
+
+    // One "frame;frame;row self_ns" line per stack, as consumed by flamegraph.pl.
+    void folded(std::ostream& out) const {
+        for (auto& [stack, self] : stacks)
+            out << stack << ' ' << self.count() << '\n';
+    }
+
+private:
+    std::vector<std::string> frames_;
+    std::vector<duration> nested_;
+};
+
+class executor {
+private:
+    constexpr const static int max_include_depth = 16;
+
+    int depth{0};
+    std::unordered_map<int, std::string> stack_names_;
+
+    template<typename Source>
+    const std::string& stack_name(Source& src, int pos) {
+        auto it = stack_names_.find(pos);
+        if (it == stack_names_.end()) {
+            auto name = src.row(pos).name;
+            int parent = pos - 1;
+            while (parent >= int(src.first()) && src.space(parent) >= src.space(pos))
+                parent--;
+            it = stack_names_.emplace(pos, parent < int(src.first()) ? name : stack_name(src, parent) + ';' + name).first;
+        }
+        return it->second;
+    }
+
+    bool dispatch(const echo_row& row, const std::string& source) {
+        if (row.name == echo_script_cache::include_directive) {
+            include(row.value, source);
+            return false;
+        }
+        return echo(row);
+    }
+
+    void include(const std::string& path, const std::string& source) {
+        if (depth >= max_include_depth) {
+            std::cout << "Include depth exceeded: " << path << std::endl;
+            return;
+        }
+
+        auto full = path.empty() || path[0] == '/' ? path : echo_script_cache::directory_of(source) + path;
+        executor inner{echo_script_cache::load(full), echo, frame.target()};
+        inner.depth = depth + 1;
+        inner.run();
+    }
+
+    template<typename Source>
+    void run_source(Source& src, int pos) {
+        echo_frame::scope active{frame};
         position.emplace(pos);
-        while(!position.empty() && position.top() < script->data.size()) {
+        while(!position.empty() && src.has(position.top())) {
             //std::cout << "EXEC:" << position.top() << std::endl;
-            auto& i = script->data[position.top()];
-            bool r = echo(i);
+            auto i = src.row(position.top());
+            bool r = profiler == nullptr ? dispatch(i, src.source)
+                : profiler->measure(i.name, stack_name(src, position.top()), [&] { return dispatch(i, src.source); });
             if (!r) {
-                position.top() = next_same_level_pos(position.top());
+                if constexpr (requires { src.skip_block(0); }) {
+                    if (position.size() == 1) {
+                        position.top() = src.skip_block(position.top());
+                        stack_names_.clear();
+                    } else {
+                        position.top() = src.next_same_level(position.top());
+                    }
+                } else {
+                    position.top() = src.next_same_level(position.top());
+                }
                 if (position.top() == -1) {
                     position.pop();
                 }
-            } else if (pos_exsists(position.top() + 1)) {
-                if (script->data[position.top() + 1].space > i.space) {
+            } else if (src.has(position.top() + 1)) {
+                if (src.space(position.top() + 1) > i.space) {
                     position.emplace(position.top() + 1);
                 }
             }
+
+            if constexpr (requires { src.release(0); }) {
+                if (position.size() == 1 && position.top() > int(src.first())) {
+                    src.release(position.top());
+                    stack_names_.clear();
+                }
+            }
         }
     }
 
+public:
+    echo_func echo;
+    std::stack<int> position;
+    std::shared_ptr<const echo_script> script;
+    echo_profiler* profiler{echo_profiler::current};
+    echo_frame frame;
+
+    executor(std::shared_ptr<const echo_script> trg, echo_func echo, void* target = nullptr) : echo(echo), script(trg), frame(target) {}
+
+    void run(int pos = 0) {
+        run_source(*script, pos);
+    }
+
+    void run(echo_stream& stream) {
+        run_source(stream, stream.first());
+    }
+
     int exit_position(int start) {
         int r = start;
-        while (script->data[r].space >= script->data[start].space)
+        while (script->space(r) >= script->space(start))
             r++;
         return r;
     }
@@ -169,13 +806,13 @@ struct echo_path {
 struct echo_mapping {
     std::map<std::string, echo_func> mappings;
 
-    bool operator()(echo_row row) {
-        std::string path = echo_path::first(row.name);
+    bool operator()(echo_row row) const {
+        auto it = mappings.find(echo_path::first(row.name));
 
-        if (mappings.find(path) == mappings.end())
+        if (it == mappings.end())
             return false;
 
-        return mappings[path](echo_path::remove_first(row));
+        return it->second(echo_path::remove_first(row));
     }
 
     static echo_mapping create_default_controls();
@@ -183,9 +820,10 @@ struct echo_mapping {
 
 struct echo_single_shot {
     echo_func function;
-    bool shot{true};
+    size_t slot{echo_frame::new_slot()};
 
-    bool operator()(echo_row row) {
+    static bool fire(size_t slot, const echo_row& row) {
+        auto& shot = echo_frame::get().value(slot, true);
         if (row.value == "update") {
             shot = true;
             return false;
@@ -193,19 +831,25 @@ struct echo_single_shot {
 
         if(shot) {
             shot = false;
-            return function(row);
+            return true;
         }
         return false;
     }
+
+    bool operator()(echo_row row) const {
+        return fire(slot, row) && function(row);
+    }
 };
 
 struct echo_multi_shot {
     echo_func function;
     size_t shot{1};
+    size_t slot{echo_frame::new_slot()};
 
-    bool operator()(echo_row row) {
-        if(shot != 0) {
-            shot--;
+    bool operator()(echo_row row) const {
+        auto& left = echo_frame::get().value(slot, shot);
+        if(left != 0) {
+            left--;
             return function(row);
         }
         return false;
@@ -297,15 +941,18 @@ struct echo_object : public echo_mapping {
 };
 
 struct echo_cycle {
-    size_t times = 0ULL - 2ULL;
+    constexpr const static size_t idle = 0ULL - 2ULL;
 
-    bool operator()(echo_row row) {
+    size_t slot{echo_frame::new_slot()};
+
+    bool operator()(echo_row row) const {
+        auto& times = echo_frame::get().value(slot, idle);
         if (row.value == "update") {
-            times = 0ULL - 2ULL;
+            times = idle;
             return false;
         }
 
-        if (times == 0ULL - 2) {
+        if (times == idle) {
             times = std::stoull(row.value);
         }
 
@@ -317,6 +964,34 @@ struct echo_cycle {
     }
 };
 
+// Object slot of a shared table: the pointer lives in the frame's target, and
+// the object's own mappings are built once per frame on first use.
+template<typename Owner, echo_object_type T, typename Ptr = T*>
+struct echo_bound_object {
+    Ptr Owner::* member;
+    const std::map<std::string, std::function<Ptr()>>* inits;
+
+    bool operator()(echo_row row) const {
+        auto& frame = echo_frame::get();
+        Ptr& ptr = frame.target<Owner>().*member;
+        if (!ptr) {
+            auto it = inits->find(row.value);
+            if (it == inits->end())
+                return false;
+
+            ptr = it->second();
+            return true;
+        }
+
+        T* obj = &*ptr;
+        return frame.object(obj, [obj] {
+            echo_mapping map;
+            obj->init_mappings(&map);
+            return echo_func{map};
+        })(row);
+    }
+};
+
 echo_mapping echo_mapping::create_default_controls() {
     echo_mapping res;
     echo_mapping echo_map;
@@ -325,6 +1000,7 @@ echo_mapping echo_mapping::create_default_controls() {
         echo_map.mappings["single"] = echo_single_shot{};
         echo_map.mappings["cout"] = [](echo_row row){std::cout << row.value; return false;};
         echo_map.mappings["coutn"] = [](echo_row row){std::cout << row.value << std::endl; return false;};
+        echo_map.mappings["compile"] = [](echo_row row){echo_script::compile_file(row.value); return false;};
         echo_map.mappings["log"] = [](echo_row row){std::cout << "[" << row.space << "]" << row.value << std::endl;return false;};
         echo_map.mappings["answer"] = [](echo_row row){std::cout << row.value << "(1 - to accept, other - deceline):\n"; int a; std::cin >> a; return a == 1; };
     }
@@ -332,6 +1008,10 @@ echo_mapping echo_mapping::create_default_controls() {
     return res;
 }
 
+echo_func echo_bind_shared(std::shared_ptr<const echo_mapping> map) {
+    return [map](echo_row row)->bool{return (*map)(row);};
+}
+
 echo_func echo_bind_function(::Function<void> func) {
     return [=](echo_row row)->bool{func(); return false;};
 }
@@ -401,16 +1081,34 @@ struct echo_generic_mapping {
     using value_type = T;
     using reference_type = T&;
 
-    bool operator()(T& target, echo_row row) {
-        std::string path = echo_path::first(row.name);
+    bool operator()(T& target, echo_row row) const {
+        auto it = mappings.find(echo_path::first(row.name));
 
-        if (mappings.find(path) == mappings.end())
+        if (it == mappings.end())
             return false;
 
-        return mappings[path](target, echo_path::remove_first(row));
+        return it->second(target, echo_path::remove_first(row));
+    }
+};
+
+template<typename T>
+struct echo_generic_single_shot {
+    echo_generic_func<T> function;
+    size_t slot{echo_frame::new_slot()};
+
+    bool operator()(T& target, echo_row row) const {
+        return echo_single_shot::fire(slot, row) && function(target, row);
     }
 };
 
+// Binds a generic mapping to a member of the frame's target.
+template<typename Owner, typename T>
+echo_func echo_bind_member(T Owner::* member, echo_generic_mapping<T> mapping) {
+    return [member, mapping](echo_row row)->bool {
+        return mapping(echo_frame::get().target<Owner>().*member, row);
+    };
+}
+
 
 struct echo_generic_field : public echo_generic_mapping<std::string> {
     echo_generic_field() : echo_generic_mapping<value_type>() {
@@ -418,6 +1116,23 @@ struct echo_generic_field : public echo_generic_mapping<std::string> {
         this->mappings["cout"] = [](value_type& str, echo_row row) { std::cout << str; return false;};
         this->mappings["coutn"] = [](std::string& str, echo_row row) { std::cout << str << std::endl; return false;};
         this->mappings["clear"] = [](std::string& str, echo_row row) {str = std::string{}; return false;};
+        this->mappings["is_empty"] = echo_generic_single_shot<value_type>{[](value_type& str, echo_row row) -> bool { return str.empty();}};
+    }
+};
+
+struct echo_generic_set_field : public echo_generic_mapping<std::set<std::string>> {
+    echo_generic_set_field() : echo_generic_mapping<value_type>() {
+        this->mappings["add"] = [](value_type& set, echo_row row) { set.emplace(row.value); return false;};
+        this->mappings["remove"] = [](value_type& set, echo_row row) { set.erase(row.value); return false;};
+        this->mappings["contains"] = echo_generic_single_shot<value_type>{[](value_type& set, echo_row row) -> bool {
+            return set.find(row.value) != set.end();
+        }};
+        this->mappings["coutn"] = [](value_type& set, echo_row row) {
+            for (auto& i : set)
+                std::cout << row.value << i << std::endl;
+            return false;
+        };
+        this->mappings["coutsize"] = [](value_type& set, echo_row row) { std::cout << set.size(); return false;};
     }
 };
 
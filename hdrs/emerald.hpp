@@ -5,24 +5,139 @@
 #include <string>
 
 #include <set>
+#include <unordered_set>
+#include <optional>
+#include <limits>
 #include <filesystem>
 #include <string>
 #include <stack>
+#include <deque>
+#include <random>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <array>
+#include <ctime>
+#include <cstdio>
+#include <thread>
+#include <shared_mutex>
+#include <condition_variable>
+
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 namespace fs = std::__fs::filesystem;
 
 struct Emerald {
     struct Storage;
+    struct Listings;
     struct Compile;
+    struct Daemon;
     struct EchoExtension;
 };
 
 struct EmeraldUnit;
 
+// Owning handle of a unit stage. Shared (stateless) stages only drop their
+// reference count; pooled ones are handed back to the pool they came from.
+template<typename T>
+struct EmeraldStageDeleter {
+    void (*release)(T*){nullptr};
+
+    void operator()(T* ptr) const {
+        if (release != nullptr)
+            release(ptr);
+    }
+};
+
+template<typename T>
+using EmeraldStage = std::unique_ptr<T, EmeraldStageDeleter<T>>;
+
+struct EmeraldPoolStats {
+    inline static std::atomic<size_t> Objects{0};
+    inline static std::atomic<size_t> Bytes{0};
+    inline static std::atomic<size_t> Shared{0};
+};
+
+template<typename T>
+struct EmeraldPool {
+private:
+    constexpr const static size_t ChunkSize = 256;
+
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    // Never destroyed: units in static storage may outlive any static pool.
+    struct State {
+        std::mutex lock;
+        std::vector<std::unique_ptr<Slot[]>> chunks;
+        Slot* free{nullptr};
+    };
+
+    static State& State_() {
+        static State* state = new State{};
+        return *state;
+    }
+
+    template<typename Base>
+    static void Release(Base* ptr) {
+        auto obj = static_cast<T*>(ptr);
+        obj->~T();
+        auto slot = reinterpret_cast<Slot*>(obj);
+
+        auto& state = State_();
+        std::lock_guard lock{state.lock};
+        slot->next = state.free;
+        state.free = slot;
+        EmeraldPoolStats::Objects--;
+        EmeraldPoolStats::Bytes -= sizeof(T);
+    }
+
+public:
+    template<typename Base>
+    static EmeraldStage<Base> Create() {
+        auto& state = State_();
+        Slot* slot;
+        {
+            std::lock_guard lock{state.lock};
+            if (state.free == nullptr) {
+                state.chunks.emplace_back(new Slot[ChunkSize]);
+                for (size_t i = 0; i < ChunkSize; i++) {
+                    state.chunks.back()[i].next = state.free;
+                    state.free = &state.chunks.back()[i];
+                }
+            }
+            slot = state.free;
+            state.free = slot->next;
+            EmeraldPoolStats::Objects++;
+            EmeraldPoolStats::Bytes += sizeof(T);
+        }
+        return EmeraldStage<Base>{new (slot->storage) T{}, EmeraldStageDeleter<Base>{Release<Base>}};
+    }
+};
+
+template<typename T>
+struct EmeraldShared {
+    template<typename Base>
+    static void Release(Base* ptr) {
+        EmeraldPoolStats::Shared--;
+    }
+
+    template<typename Base>
+    static EmeraldStage<Base> Create() {
+        static T instance{};
+        EmeraldPoolStats::Shared++;
+        return EmeraldStage<Base>{&instance, EmeraldStageDeleter<Base>{Release<Base>}};
+    }
+};
+
 template<typename T>
 struct EmeraldInit {
     using value = T;
-    using pointer = T*;
+    using pointer = EmeraldStage<T>;
     inline static std::map<std::string, std::function<pointer()>> Inits{};
     EmeraldInit(std::string name, std::function<pointer()> init) {
         Inits.emplace(name, init);
@@ -104,19 +219,95 @@ struct TagChecker {
     }
 };
 
+struct AttributeValue {
+    enum class Type {
+        Integer,
+        Float,
+        Date,
+    };
+
+    Type type;
+    double value;
+
+    bool IsDate() const {
+        return type == Type::Date;
+    }
+
+    static bool IsValidDate(int year, int month, int day) {
+        static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        if (month < 1 || month > 12 || day < 1)
+            return false;
+        bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+        return day <= days[month - 1] + (month == 2 && leap);
+    }
+
+    // Dates are YYYY-MM-DD and stored as YYYYMMDD so they keep their order.
+    // Impossible dates such as 2024-13-45 are not attribute values.
+    static std::optional<AttributeValue> Parse(const std::string& str) {
+        if (str.empty())
+            return std::nullopt;
+
+        static const std::regex date{"(\\d{4})-(\\d{2})-(\\d{2})"};
+        std::smatch match;
+        if (std::regex_match(str, match, date)) {
+            int year = std::stoi(match[1]), month = std::stoi(match[2]), day = std::stoi(match[3]);
+            if (!IsValidDate(year, month, day))
+                return std::nullopt;
+            return AttributeValue{Type::Date, year * 10000.0 + month * 100 + day};
+        }
+
+        auto begin = str.data(), end = str.data() + str.size();
+        long long integer;
+        auto parsed = std::from_chars(begin, end, integer);
+        if (parsed.ec == std::errc{} && parsed.ptr == end)
+            return AttributeValue{Type::Integer, double(integer)};
+
+        // Only plain decimal numbers; nan or inf would break the sorted index.
+        // strtod also takes hex, words and leading blanks, so those are
+        // filtered out first.
+        if (str[0] == '+' || str.find_first_not_of("0123456789.eE+-") != std::string::npos)
+            return std::nullopt;
+        char* real_end;
+        double real = std::strtod(begin, &real_end);
+        if (real_end == end && std::isfinite(real))
+            return AttributeValue{Type::Float, real};
+
+        return std::nullopt;
+    }
+};
+
+// Attribute comparison term of a request: @name>=v, @name>v, @name<=v,
+// @name<v, @name=v or the inclusive range @name=a..b.
+struct AttributePredicate {
+    std::string name;
+    bool date{false};
+    double low{-std::numeric_limits<double>::infinity()};
+    double high{std::numeric_limits<double>::infinity()};
+    bool low_inclusive{true};
+    bool high_inclusive{true};
+
+    static std::optional<AttributePredicate> Parse(const std::string& term);
+};
+
+// Per compile setup of the stages. Steps that ask for input read it from the
+// stream given to Init, so compiles without a console can answer them.
 struct EmeraldStatic {
 private:
-    inline static std::vector<std::function<void()>> Coll_{};
+    inline static std::vector<std::function<void(std::istream&)>> Coll_{};
 public:
     EmeraldStatic(std::function<void()> a) {
+       Coll_.emplace_back([a](std::istream&) { a(); });
+    }
+
+    EmeraldStatic(std::function<void(std::istream&)> a) {
        Coll_.emplace_back(a);
     }
 
-    static void Init() {
+    static void Init(std::istream& input = std::cin) {
         std::cout << "Begin static init!" << std::endl;
         for (auto i : Coll_) {
             std::cout << '.' << std::endl;
-            i();
+            i(input);
         }
     }
 };
@@ -128,8 +319,16 @@ enum class CompilationRound {
 
 class CompilationService {
 public:
+    virtual ~CompilationService() = default;
+
     virtual void CompilationMsg(CompilationRound round, const EmeraldUnit& reffered) = 0;
     virtual void init_mappings(echolang::echo_mapping* map) = 0;
+
+    // Identifies the stage configuration for cached results; stages whose
+    // behaviour depends on their settings have to include them.
+    virtual std::string Signature() const {
+        return typeid(*this).name();
+    }
 };
 
 class InnerSelector : public CompilationService {
@@ -150,9 +349,64 @@ public:
     virtual bool Satisfies(fs::path file, int index, const EmeraldUnit& src) = 0;
 };
 
+// How compiled files are spread over sub folders of the output. Ordinal is
+// the position of the file in the whole compile.
+struct OutputLayout {
+    enum class Mode {
+        Flat,
+        Range,
+        Unit,
+        Hash,
+    };
+
+    Mode LayoutMode{Mode::Flat};
+    size_t Width{1000};
+
+    static OutputLayout& Current() {
+        static OutputLayout layout{};
+        return layout;
+    }
+
+    static bool Parse(const std::string& spec, OutputLayout& out) {
+        auto split = spec.find(':');
+        auto mode = spec.substr(0, split);
+        auto arg = split == std::string::npos ? std::string{} : spec.substr(split + 1);
+
+        // A rejected spec leaves `out` untouched, a zero width would divide by zero.
+        size_t width = 0;
+        if (!arg.empty()) {
+            auto end = arg.data() + arg.size();
+            auto [ptr, ec] = std::from_chars(arg.data(), end, width);
+            if (ec != std::errc{} || ptr != end || width == 0)
+                return false;
+        }
+
+        OutputLayout res;
+        if (mode == "flat")
+            res = OutputLayout{Mode::Flat};
+        else if (mode == "unit")
+            res = OutputLayout{Mode::Unit};
+        else if (mode == "range")
+            res = OutputLayout{Mode::Range, arg.empty() ? 1000 : width};
+        else if (mode == "hash")
+            res = OutputLayout{Mode::Hash, arg.empty() ? 2 : std::min<size_t>(width, 16)};
+        else
+            return false;
+        out = res;
+        return true;
+    }
+
+    fs::path Shard(const std::string& name, size_t ordinal, const EmeraldUnit& src) const;
+};
+
 class Namer : public CompilationService {
 public:
     virtual std::string MakeName(fs::path file, int index, const EmeraldUnit& src) = 0;
+
+    // Output sub folder for a named file; an empty path keeps it at the top.
+    virtual fs::path MakeShard(const std::string& name, size_t ordinal, const EmeraldUnit& src) {
+        return OutputLayout::Current().Shard(name, ordinal, src);
+    }
 };
 
 struct EmeraldUnit {
@@ -175,169 +429,1576 @@ private:
         return tag[name.size() + 1] == AttributeValueSpacerSymbol;
     }
 
+    bool Staged_{true};
+    // Results of the rows run by the tag pass of a lazy load, in order.
+    std::vector<bool> Trace_;
+
+    static bool IsStageRow(const echolang::echo_row& row) {
+        auto name = std::string_view{row.name}.substr(0, row.name.find('/'));
+        return name == "InnerSelector" || name == "Sorter" || name == "OuterSelector" || name == "Namer";
+    }
+
+public:
+    constexpr const static char AttributeSymbol = '@';
+    constexpr const static char AttributeValueSpacerSymbol = ':';
+    inline static const std::string UnitInitFile = "Unit.emerald";
+
+    std::string Name;
+    std::string Path;
+    std::string Root;
+    std::set<std::string> Tags;
+    std::map<std::string, AttributeValue> Values;
+
+    EmeraldStage<InnerSelector> FInSelector;
+    EmeraldStage<Sorter> FSorter;
+    EmeraldStage<OuterSelector> FOutSelector;
+    EmeraldStage<Namer> FNamer;
+
+    EmeraldUnit() {}
+    EmeraldUnit(fs::path path, bool lazy = false) : Path(path) {
+        auto init_path = path/UnitInitFile;
+        if (fs::exists(init_path)) {
+            if (lazy) {
+                auto tags = echolang::echo_bind_shared(TagMappings());
+                FromScript(init_path, [this, &tags](echolang::echo_row row) {
+                    bool res = tags(row);
+                    if (!IsStageRow(row))
+                        Trace_.push_back(res);
+                    return res;
+                });
+            } else {
+                FromScript(init_path);
+            }
+            Staged_ = !lazy;
+        }
+        ParseAttributes();
+    }
+
+    static bool IsUnit(fs::path path) {
+        return fs::exists(path/UnitInitFile);
+    }
+
+    static void init_mappings(echolang::echo_mapping* map) {
+        map->mappings["Name"] = echolang::generic::echo_bind_member(&EmeraldUnit::Name, echolang::generic::echo_generic_field{});
+        {
+            auto tag = echolang::generic::echo_generic_set_field{};
+            tag.mappings["ContainsAttribute"] = echolang::generic::echo_generic_single_shot<std::set<std::string>>{
+                [](std::set<std::string>& tags, echolang::echo_row row) {
+                    return echolang::echo_frame::get().target<EmeraldUnit>().ContainsAttribute(row.value);
+                }
+            };
+            map->mappings["Tags"] = echolang::generic::echo_bind_member(&EmeraldUnit::Tags, echolang::generic::echo_generic_mapping<std::set<std::string>>{tag});
+        }
+        map->mappings["InnerSelector"] = echolang::echo_bound_object<EmeraldUnit, InnerSelector, EmeraldStage<InnerSelector>>{&EmeraldUnit::FInSelector, &EmeraldInit<InnerSelector>::Inits};
+        map->mappings["Sorter"] = echolang::echo_bound_object<EmeraldUnit, Sorter, EmeraldStage<Sorter>>{&EmeraldUnit::FSorter, &EmeraldInit<Sorter>::Inits};
+        map->mappings["OuterSelector"] = echolang::echo_bound_object<EmeraldUnit, OuterSelector, EmeraldStage<OuterSelector>>{&EmeraldUnit::FOutSelector, &EmeraldInit<OuterSelector>::Inits};
+        map->mappings["Namer"] = echolang::echo_bound_object<EmeraldUnit, Namer, EmeraldStage<Namer>>{&EmeraldUnit::FNamer, &EmeraldInit<Namer>::Inits};
+    }
+
+    static std::shared_ptr<const echolang::echo_mapping> SharedMappings() {
+        static auto shared = [] {
+            auto map = std::make_shared<echolang::echo_mapping>(echolang::echo_mapping::create_default_controls());
+            init_mappings(map.get());
+            return std::shared_ptr<const echolang::echo_mapping>{map};
+        }();
+        return shared;
+    }
+
+    // Only Name and Tags; stage rows are unknown here, so their blocks are skipped.
+    static std::shared_ptr<const echolang::echo_mapping> TagMappings() {
+        static auto shared = [] {
+            auto map = std::make_shared<echolang::echo_mapping>(echolang::echo_mapping::create_default_controls());
+            auto full = SharedMappings();
+            map->mappings["Name"] = full->mappings.at("Name");
+            map->mappings["Tags"] = full->mappings.at("Tags");
+            return std::shared_ptr<const echolang::echo_mapping>{map};
+        }();
+        return shared;
+    }
+
+    static EmeraldUnit* CreateEmpty() {
+        return new EmeraldUnit();
+    }
+
+    void FromScript(fs::path file, echolang::echo_func mapping) {
+        auto sc = echolang::echo_script_cache::load(file);
+
+        echolang::executor exec{sc, mapping, this};
+        exec.run();
+    }
+
+    void FromScript(fs::path file, std::shared_ptr<const echolang::echo_mapping> mappings = SharedMappings()) {
+        FromScript(file, echolang::echo_bind_shared(mappings));
+    }
+
+    bool IsStaged() const {
+        return Staged_;
+    }
+
+    // Builds the stage objects of a lazily loaded unit. Rows the tag pass ran
+    // answer from its trace without running again, so only the stage blocks it
+    // skipped are executed, each exactly once.
+    void Stage() {
+        if (Staged_)
+            return;
+        Staged_ = true;
+
+        auto full = echolang::echo_bind_shared(SharedMappings());
+        size_t next = 0;
+        const echolang::echo_frame* block = nullptr;
+        int block_space = 0;
+        FromScript(fs::path{Path}/UnitInitFile, [&](echolang::echo_row row) {
+            auto frame = &echolang::echo_frame::get();
+            if (block == frame && row.space <= block_space)
+                block = nullptr;
+            if (block == nullptr && !IsStageRow(row))
+                return next < Trace_.size() && Trace_[next++];
+
+            bool res = full(row);
+            if (res && block == nullptr) {
+                block = frame;
+                block_space = row.space;
+            }
+            return res;
+        });
+        Trace_ = {};
+    }
+
+    bool ContainsAttribute(const std::string& name) const {
+        auto it = Tags.lower_bound(AttributeSymbol + name + AttributeValueSpacerSymbol);
+
+        if (it == Tags.end())
+            return false;
+
+        return IsAttribute(name, *it);
+    }
+
+    const std::string& GetAttribute(const std::string& name) const {
+        return *Tags.lower_bound(AttributeSymbol + name + AttributeValueSpacerSymbol);
+    }
+
+    static bool IsValuedAttribute(const std::string& attr) {
+        return attr.find(AttributeValueSpacerSymbol) != std::string::npos;
+    }
+
+    static std::string ValueFromAttribute(const std::string& attr) {
+        return attr.substr(attr.find(AttributeValueSpacerSymbol) + 1);
+    }
+
+    static std::string NameFromAttribute(const std::string& attr) {
+        return attr.substr(1, attr.find(AttributeValueSpacerSymbol) - 1);
+    }
+
+    void ParseAttributes() {
+        Values.clear();
+        for (auto it = Tags.lower_bound(std::string{AttributeSymbol}); it != Tags.end() && (*it)[0] == AttributeSymbol; it++) {
+            if (!IsValuedAttribute(*it))
+                continue;
+            if (auto value = AttributeValue::Parse(ValueFromAttribute(*it)))
+                Values.emplace(NameFromAttribute(*it), *value);
+        }
+    }
+
+    void SetAttribute(const std::string& name, std::string&& value) {
+        if (ContainsAttribute(name))
+            Tags.erase(GetAttribute(name));
+
+        if (auto typed = AttributeValue::Parse(value))
+            Values.insert_or_assign(name, *typed);
+        else
+            Values.erase(name);
+
+        Tags.emplace(AttributeSymbol + name + AttributeValueSpacerSymbol + value);
+    }
+
+    size_t MemoryUsage() const {
+        constexpr size_t node = 4 * sizeof(void*);
+        // Short strings live inside the object itself, the threshold differs between libraries.
+        auto heap = [](const std::string& str) {
+            auto data = str.data();
+            auto self = reinterpret_cast<const char*>(&str);
+            bool inside = !std::less<const char*>{}(data, self) && std::less<const char*>{}(data, self + sizeof(str));
+            return inside ? 0 : str.capacity() + 1;
+        };
+
+        size_t res = sizeof(EmeraldUnit) + heap(Name) + heap(Path) + heap(Root);
+        for (auto& tag : Tags)
+            res += node + sizeof(std::string) + heap(tag);
+        for (auto& [name, value] : Values)
+            res += node + sizeof(std::pair<const std::string, AttributeValue>) + heap(name);
+        return res;
+    }
+};
+
+fs::path OutputLayout::Shard(const std::string& name, size_t ordinal, const EmeraldUnit& src) const {
+    std::stringstream shard;
+    switch (LayoutMode) {
+        case Mode::Flat:
+            return {};
+        case Mode::Range:
+            shard << std::setw(6) << std::setfill('0') << ordinal / Width;
+            break;
+        case Mode::Unit:
+            // The name comes from the unit script; only a plain folder name is
+            // safe to use, anything else falls back to the unit's own folder.
+            if (src.Name.empty() || src.Name == "." || src.Name == ".." || src.Name.find('/') != std::string::npos)
+                shard << fs::path{src.Path}.filename().string();
+            else
+                shard << src.Name;
+            break;
+        case Mode::Hash:
+            shard << std::hex << std::setw(16) << std::setfill('0') << std::hash<std::string>{}(name);
+            return shard.str().substr(0, Width);
+    }
+    return shard.str();
+}
+
+std::optional<AttributePredicate> AttributePredicate::Parse(const std::string& term) {
+    if (term.size() < 2 || term[0] != EmeraldUnit::AttributeSymbol)
+        return std::nullopt;
+
+    auto op = term.find_first_of("<>=");
+    if (op == std::string::npos || op == 1)
+        return std::nullopt;
+
+    AttributePredicate res;
+    res.name = term.substr(1, op - 1);
+
+    auto sign = term.substr(op, term.size() > op + 1 && term[op + 1] == '=' ? 2 : 1);
+    auto value = term.substr(op + sign.size());
+
+    auto range = value.find("..");
+    auto low = AttributeValue::Parse(range == std::string::npos ? value : value.substr(0, range));
+    if (!low)
+        return std::nullopt;
+    res.date = low->IsDate();
+
+    if (range != std::string::npos) {
+        auto high = AttributeValue::Parse(value.substr(range + 2));
+        if (sign != "=" || !high || high->IsDate() != res.date)
+            return std::nullopt;
+        res.low = low->value;
+        res.high = high->value;
+    } else if (sign == "=") {
+        res.low = res.high = low->value;
+    } else if (sign[0] == '>') {
+        res.low = low->value;
+        res.low_inclusive = sign == ">=";
+    } else if (sign[0] == '<') {
+        res.high = low->value;
+        res.high_inclusive = sign == "<=";
+    } else {
+        return std::nullopt;
+    }
+    return res;
+}
+
+// Per attribute lists of (value, unit index) sorted by value; dates and
+// numbers of the same attribute are kept apart since they do not compare.
+struct AttributeIndex {
+private:
+    using entry = std::pair<double, size_t>;
+
+    std::map<std::pair<std::string, bool>, std::vector<entry>> values_;
+
+public:
+    template<typename Units>
+    void Build(const Units& units) {
+        values_.clear();
+        size_t index = 0;
+        for (auto& unit : units) {
+            for (auto& [name, value] : unit.Values)
+                values_[{name, value.IsDate()}].emplace_back(value.value, index);
+            index++;
+        }
+        for (auto& [key, list] : values_)
+            std::sort(list.begin(), list.end());
+    }
+
+    const std::vector<entry>* Values(const std::string& name, bool date) const {
+        auto it = values_.find({name, date});
+        return it == values_.end() ? nullptr : &it->second;
+    }
+
+    std::vector<size_t> Match(const AttributePredicate& pred) const {
+        std::vector<size_t> res;
+        auto it = values_.find({pred.name, pred.date});
+        if (it == values_.end())
+            return res;
+
+        auto& list = it->second;
+        auto begin = pred.low_inclusive
+            ? std::lower_bound(list.begin(), list.end(), pred.low, [](const entry& e, double v) { return e.first < v; })
+            : std::upper_bound(list.begin(), list.end(), pred.low, [](double v, const entry& e) { return v < e.first; });
+        auto end = pred.high_inclusive
+            ? std::upper_bound(begin, list.end(), pred.high, [](double v, const entry& e) { return v < e.first; })
+            : std::lower_bound(begin, list.end(), pred.high, [](const entry& e, double v) { return e.first < v; });
+
+        for (auto i = begin; i < end; i++)
+            res.push_back(i->second);
+        return res;
+    }
+
+    std::vector<bool> MatchMask(const AttributePredicate& pred, size_t units) const {
+        std::vector<bool> mask(units);
+        for (auto i : Match(pred))
+            mask[i] = true;
+        return mask;
+    }
+};
+
+// Every distinct tag in sorted order with the units carrying it. Prefix and
+// wildcard terms ("series/*", "artist/?ane") are resolved against it once per
+// query instead of matching strings for every unit.
+struct TagDictionary {
+private:
+    std::vector<std::string> tags_;
+    std::vector<std::vector<size_t>> units_;
+
+    static bool Glob(const char* pattern, const char* text) {
+        const char* star = nullptr;
+        const char* resume = nullptr;
+        while (*text) {
+            if (*pattern == '*') {
+                star = pattern++;
+                resume = text;
+            } else if (*pattern == '?' || *pattern == *text) {
+                pattern++;
+                text++;
+            } else if (star) {
+                pattern = star + 1;
+                text = ++resume;
+            } else {
+                return false;
+            }
+        }
+        while (*pattern == '*')
+            pattern++;
+        return *pattern == 0;
+    }
+
+public:
+    static bool IsPattern(const std::string& term) {
+        return term.find_first_of("*?") != std::string::npos;
+    }
+
+    template<typename Units>
+    void Build(const Units& units) {
+        std::map<std::string, std::vector<size_t>> tags;
+        size_t index = 0;
+        for (auto& unit : units) {
+            for (auto& tag : unit.Tags)
+                tags[tag].push_back(index);
+            index++;
+        }
+
+        tags_.clear();
+        units_.clear();
+        tags_.reserve(tags.size());
+        units_.reserve(tags.size());
+        for (auto& [tag, list] : tags) {
+            tags_.push_back(tag);
+            units_.push_back(std::move(list));
+        }
+    }
+
+    size_t size() const {
+        return tags_.size();
+    }
+
+    // Calls func with the position of every tag matching the pattern; only the
+    // range sharing the literal prefix is scanned.
+    template<typename Func>
+    void Each(const std::string& pattern, Func func) const {
+        auto wild = pattern.find_first_of("*?");
+        auto prefix = pattern.substr(0, wild);
+        bool trailing = wild == pattern.size() - 1 && pattern[wild] == '*';
+
+        for (auto it = std::lower_bound(tags_.begin(), tags_.end(), prefix); it != tags_.end() && it->compare(0, prefix.size(), prefix) == 0; it++) {
+            if (trailing || Glob(pattern.c_str() + prefix.size(), it->c_str() + prefix.size()))
+                func(it - tags_.begin());
+        }
+    }
+
+    std::vector<std::string> Match(const std::string& pattern) const {
+        std::vector<std::string> res;
+        Each(pattern, [&](size_t tag) { res.push_back(tags_[tag]); });
+        return res;
+    }
+
+    std::vector<bool> MatchMask(const std::string& pattern, size_t units) const {
+        std::vector<bool> mask(units);
+        Each(pattern, [&](size_t tag) {
+            for (auto i : units_[tag])
+                mask[i] = true;
+        });
+        return mask;
+    }
+};
+
+// Evaluates many polish notation requests in one pass over the units.
+// Requests are hash-consed into one expression graph, so subexpressions shared
+// between requests are computed once, and every node is evaluated for all
+// units at once as a bitset.
+struct TagQueryBatch {
+private:
+    using bitset = std::vector<uint64_t>;
+
+    struct node {
+        char op;
+        int left;
+        int right;
+        std::string tag;
+
+        auto key() const {
+            return std::tie(op, left, right, tag);
+        }
+
+        bool operator<(const node& other) const {
+            return key() < other.key();
+        }
+    };
+
+    std::vector<node> nodes_;
+    std::map<node, int> known_;
+    std::map<std::string, int> queries_;
+
+    int add_node(node n) {
+        auto it = known_.find(n);
+        if (it != known_.end())
+            return it->second;
+        nodes_.push_back(n);
+        known_.emplace(n, nodes_.size() - 1);
+        return nodes_.size() - 1;
+    }
+
+    int parse(const std::vector<std::string>& req, size_t& i) {
+        if (i >= req.size() || req[i].empty())
+            return -1;
+
+        auto& token = req[i++];
+        if (token == "&" || token == "|") {
+            int left = parse(req, i);
+            int right = parse(req, i);
+            if (left == -1 || right == -1)
+                return -1;
+            return add_node(node{token[0], std::min(left, right), std::max(left, right), ""});
+        }
+        if (token == "!") {
+            int arg = parse(req, i);
+            if (arg == -1)
+                return -1;
+            return add_node(node{'!', arg, -1, ""});
+        }
+        return add_node(node{'t', -1, -1, token});
+    }
+
+public:
+    bool add(const std::string& name, const std::string& request) {
+        size_t i = 0;
+        int root = parse(TagChecker::parse(request), i);
+        if (root == -1)
+            return false;
+        queries_[name] = root;
+        return true;
+    }
+
+    size_t size() const {
+        return queries_.size();
+    }
+
+    size_t nodes() const {
+        return nodes_.size();
+    }
+
+    template<typename Units>
+    std::map<std::string, std::vector<typename Units::value_type*>> run(Units& units, const AttributeIndex* index = nullptr, const TagDictionary* dictionary = nullptr) const {
+        size_t words = (units.size() + 63) / 64;
+        std::vector<bitset> values(nodes_.size());
+
+        std::unordered_map<std::string, int> leaves;
+        for (int n = 0; n < int(nodes_.size()); n++) {
+            if (nodes_[n].op != 't')
+                continue;
+            values[n].assign(words, 0);
+            auto pred = AttributePredicate::Parse(nodes_[n].tag);
+            if (pred && index != nullptr) {
+                for (auto i : index->Match(*pred))
+                    values[n][i / 64] |= uint64_t(1) << (i % 64);
+            } else if (dictionary != nullptr && TagDictionary::IsPattern(nodes_[n].tag)) {
+                auto mask = dictionary->MatchMask(nodes_[n].tag, units.size());
+                for (size_t i = 0; i < mask.size(); i++)
+                    if (mask[i])
+                        values[n][i / 64] |= uint64_t(1) << (i % 64);
+            } else {
+                leaves.emplace(nodes_[n].tag, n);
+            }
+        }
+
+        size_t position = 0;
+        for (auto& unit : units) {
+            for (auto& tag : unit.Tags) {
+                auto it = leaves.find(tag);
+                if (it != leaves.end())
+                    values[it->second][position / 64] |= uint64_t(1) << (position % 64);
+            }
+            position++;
+        }
+
+        for (int n = 0; n < int(nodes_.size()); n++) {
+            auto& cur = nodes_[n];
+            if (cur.op == 't')
+                continue;
+            values[n] = values[cur.left];
+            for (size_t w = 0; w < words; w++) {
+                if (cur.op == '&')
+                    values[n][w] &= values[cur.right][w];
+                else if (cur.op == '|')
+                    values[n][w] |= values[cur.right][w];
+                else
+                    values[n][w] = ~values[n][w];
+            }
+            if (cur.op == '!' && units.size() % 64 != 0)
+                values[n][words - 1] &= (uint64_t(1) << (units.size() % 64)) - 1;
+        }
+
+        std::vector<typename Units::value_type*> all;
+        all.reserve(units.size());
+        for (auto& unit : units)
+            all.push_back(&unit);
+
+        std::map<std::string, std::vector<typename Units::value_type*>> result;
+        for (auto& [name, root] : queries_) {
+            auto& out = result[name];
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = values[root][w]; bits != 0; bits &= bits - 1)
+                    out.push_back(all[w * 64 + __builtin_ctzll(bits)]);
+            }
+        }
+        return result;
+    }
+};
+
+struct Emerald::Storage {
+    inline static std::deque<EmeraldUnit> Units{};
+
+    inline static fs::path StashPath;
+
+    struct StashRoot {
+        fs::path Path;
+        size_t CopyConcurrency{1};
+    };
+
+    inline static std::map<std::string, StashRoot> Roots{};
+
+    // Load only names and tags; stage objects are built on first compile.
+    inline static bool LazyLoading{false};
+
+    static void SetLazyLoading(std::string mode) {
+        if (mode != "on" && mode != "off") {
+            std::cout << "Expected on or off: " << mode << std::endl;
+            return;
+        }
+        LazyLoading = mode == "on";
+    }
+
+    static void SetStashPath(std::string path) {
+        StashPath = path;
+    }
+
+    static std::pair<std::string, std::string> SplitSpec(const std::string& spec) {
+        auto split = spec.find('=');
+        if (split == std::string::npos)
+            return {spec, ""};
+        return {spec.substr(0, split), spec.substr(split + 1)};
+    }
+
+    static void AddRoot(std::string spec) {
+        auto [name, path] = SplitSpec(spec);
+        if (name.empty() || path.empty()) {
+            std::cout << "Expected <name>=<path>: " << spec << std::endl;
+            return;
+        }
+        Roots[name].Path = path;
+    }
+
+    static void SetRootConcurrency(std::string spec) {
+        auto [name, count] = SplitSpec(spec);
+        auto it = Roots.find(name);
+        if (it == Roots.end() || count.empty()) {
+            std::cout << "Unknown root or count: " << spec << std::endl;
+            return;
+        }
+        it->second.CopyConcurrency = std::max(1, std::stoi(count));
+    }
+
+    // One loader thread per root so units on different disks are read in parallel.
+    static void LoadRoots(std::string path) {
+        std::vector<std::deque<EmeraldUnit>> loaded(Roots.size());
+        std::vector<std::thread> workers;
+        size_t index = 0;
+        for (auto& [name, root] : Roots) {
+            workers.emplace_back([&units = loaded[index], &name, &root, path] {
+                std::error_code ec;
+                for (auto& entry : fs::directory_iterator{root.Path/path, ec}) {
+                    if (!entry.is_directory() || !EmeraldUnit::IsUnit(entry.path()))
+                        continue;
+                    SetRoot(units.emplace_back(entry.path(), LazyLoading), name);
+                }
+            });
+            index++;
+        }
+        for (auto& worker : workers)
+            worker.join();
+
+        index = 0;
+        for (auto& [name, root] : Roots) {
+            std::cout << "Loaded " << loaded[index].size() << " units from " << name << " (" << root.Path/path << ")\n";
+            for (auto& unit : loaded[index])
+                Units.push_back(std::move(unit));
+            index++;
+        }
+        IndexDirty_ = true;
+    }
+
+    inline static std::shared_mutex Lock{};
+
+private:
+    inline static std::mutex IndexLock_{};
+    inline static AttributeIndex Index_{};
+    inline static TagDictionary Dictionary_{};
+    inline static bool IndexDirty_{true};
+
+    static void RefreshIndexes_() {
+        std::lock_guard lock{IndexLock_};
+        if (IndexDirty_) {
+            Index_.Build(Units);
+            Dictionary_.Build(Units);
+            IndexDirty_ = false;
+        }
+    }
+
+public:
+    static const AttributeIndex& Attributes() {
+        RefreshIndexes_();
+        return Index_;
+    }
+
+    static const TagDictionary& Dictionary() {
+        RefreshIndexes_();
+        return Dictionary_;
+    }
+
+    static void SetRoot(EmeraldUnit& unit, const std::string& root) {
+        unit.Root = root;
+        unit.SetAttribute("root", std::string{root});
+    }
+
+    // Units of a root are named <root>:<path below the root>, the others by
+    // their path below the stash.
+    static std::string UnitId(const EmeraldUnit& unit) {
+        auto it = Roots.find(unit.Root);
+        if (unit.Root.empty() || it == Roots.end())
+            return fs::relative(unit.Path, StashPath).string();
+        return unit.Root + ':' + fs::relative(unit.Path, it->second.Path).string();
+    }
+
+    static std::pair<std::string, fs::path> ResolveUnit(const std::string& id) {
+        auto split = id.find(':');
+        if (split != std::string::npos) {
+            auto it = Roots.find(id.substr(0, split));
+            if (it != Roots.end())
+                return {it->first, (it->second.Path/id.substr(split + 1)).lexically_normal()};
+        }
+        return {std::string{}, (StashPath/id).lexically_normal()};
+    }
+
+    static bool ReloadUnit(std::string id) {
+        auto [root, path] = ResolveUnit(id);
+        for (auto& unit : Units) {
+            if (unit.Root == root && fs::path{unit.Path}.lexically_normal() == path) {
+                unit = EmeraldUnit{path, LazyLoading};
+                if (!root.empty())
+                    SetRoot(unit, root);
+                IndexDirty_ = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void LoadUnit(std::string path) {
+        if (EmeraldUnit::IsUnit(StashPath/path)) {
+            Units.push_back(EmeraldUnit{StashPath/path, LazyLoading});
+            IndexDirty_ = true;
+        }
+    }
+
+    static std::map<std::string, size_t> CountTags() {
+        std::map<std::string, size_t> tags;
+
+        for (auto& unit : Units) {
+            for (auto& tag : unit.Tags) {
+                if (tag[0] != EmeraldUnit::AttributeSymbol)
+                    tags[tag]++;
+            }
+        }
+
+        return tags;
+    }
+
+    static void ListTags() {
+        for (auto tag : CountTags()) {
+            std::cout << std::setw(10) << tag.first << ": " << tag.second << std::endl;
+        }
+    }
+
+    static void MemoryReport() {
+        size_t units = 0, staged = 0;
+        for (auto& unit : Units) {
+            units += unit.MemoryUsage();
+            staged += unit.IsStaged();
+        }
+        size_t stages = EmeraldPoolStats::Bytes;
+        size_t count = std::max<size_t>(Units.size(), 1);
+
+        std::cout << "Units: " << Units.size() << " (" << units << " bytes, " << staged << " staged)\n";
+        std::cout << "Pooled stages: " << EmeraldPoolStats::Objects << " (" << stages << " bytes), shared stage references: " << EmeraldPoolStats::Shared << "\n";
+        std::cout << "Per unit: " << (units + stages) / count << " bytes\n";
+    }
+
+    static void CompileUnitScripts() {
+        size_t compiled = 0;
+        for (auto& unit : Units) {
+            if (echolang::echo_script::compile_file(fs::path{unit.Path}/EmeraldUnit::UnitInitFile))
+                compiled++;
+        }
+        std::cout << "Compiled " << compiled << " unit scripts\n";
+    }
+
+    static void LoadUnitsFrom(std::string path) {
+        std::cout << "Loading units from: " << StashPath/path << std::endl;
+        for (auto entry : fs::directory_iterator{StashPath/path}) {
+            if (entry.is_directory()) {
+                LoadUnit(fs::relative(entry.path(), StashPath).string());
+            }
+        }
+        std::cout << "Distinct unit scripts: " << echolang::echo_script_cache::size() << std::endl;
+    }
+
+    static void SetupStorageMappings(echolang::echo_mapping* mapping) {
+        mapping->mappings["LoadUnit"] = echolang::echo_bind_function(LoadUnit);
+        mapping->mappings["LoadUnitsFrom"] = echolang::echo_bind_function(LoadUnitsFrom);
+        mapping->mappings["SetStashPath"] = echolang::echo_bind_function(SetStashPath);
+        mapping->mappings["AddRoot"] = echolang::echo_bind_function(AddRoot);
+        mapping->mappings["SetRootConcurrency"] = echolang::echo_bind_function(SetRootConcurrency);
+        mapping->mappings["LoadRoots"] = echolang::echo_bind_function(LoadRoots);
+        mapping->mappings["SetLazyLoading"] = echolang::echo_bind_function(SetLazyLoading);
+        mapping->mappings["ListTags"] = echolang::echo_bind_function(ListTags);
+        mapping->mappings["CompileUnitScripts"] = echolang::echo_bind_function(CompileUnitScripts);
+        mapping->mappings["MemoryReport"] = echolang::echo_bind_function(MemoryReport);
+    }
+};
+
+// Filtered and sorted listings of unit folders, reused while the folder's
+// modification time and the unit's selector and sorter stay the same.
+struct Emerald::Listings {
+    struct File {
+        std::string Name;
+        uintmax_t Size;
+    };
+
+    struct Listing {
+        int64_t Time{std::numeric_limits<int64_t>::min()};
+        std::string Signature;
+        std::vector<File> Files;
+    };
+
+private:
+    // Defined after the built-in stages; false when the unit uses other ones.
+    static bool ScanBuiltin_(const EmeraldUnit& unit, std::vector<File>& files);
+
+    inline static std::unordered_map<std::string, Listing> Cache_{};
+    inline static fs::path Storage_{};
+
+    static void WriteString(std::ostream& out, const std::string& str) {
+        uint64_t size = str.size();
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.write(str.data(), size);
+    }
+
+    // Bytes left before `end`, lengths read from the cache are checked
+    // against it so a corrupt file never drives a huge allocation.
+    static uint64_t Remaining(std::istream& in, uint64_t end) {
+        auto pos = in.tellg();
+        return pos < 0 || uint64_t(pos) > end ? 0 : end - uint64_t(pos);
+    }
+
+    static bool ReadString(std::istream& in, std::string& str, uint64_t end) {
+        uint64_t size;
+        if (!in.read(reinterpret_cast<char*>(&size), sizeof(size)) || size > Remaining(in, end))
+            return false;
+        str.resize(size);
+        return bool(in.read(str.data(), size));
+    }
+
+    template<typename T>
+    static bool ReadValue(std::istream& in, T& value) {
+        return bool(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    template<typename T>
+    static void WriteValue(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+public:
+    constexpr const static uint32_t Version = 1;
+
+    inline static size_t Hits{0};
+    inline static size_t Misses{0};
+
+    static const Listing& Get(const EmeraldUnit& unit) {
+        std::error_code ec;
+        int64_t time = fs::last_write_time(unit.Path, ec).time_since_epoch().count();
+        auto signature = unit.FInSelector->Signature() + '|' + unit.FSorter->Signature();
+
+        auto& listing = Cache_[unit.Path];
+        if (!ec && listing.Time == time && listing.Signature == signature) {
+            Hits++;
+            return listing;
+        }
+        Misses++;
+
+        std::vector<File> scanned;
+        if (!ScanBuiltin_(unit, scanned)) {
+            std::vector<std::pair<fs::path, uintmax_t>> files;
+            for (auto file : fs::directory_iterator(unit.Path)) {
+                if (unit.FInSelector->Satisfies(file))
+                    files.emplace_back(file.path(), file.file_size());
+            }
+            auto comp = [&unit](const auto& a, const auto& b) {
+                return unit.FSorter->PathLessCompare(a.first, b.first);
+            };
+            std::sort(files.begin(), files.end(), comp);
+
+            for (auto& [path, size] : files)
+                scanned.push_back(File{path.filename().string(), size});
+        }
+
+        listing.Time = ec ? std::numeric_limits<int64_t>::min() : time;
+        listing.Signature = signature;
+        listing.Files = std::move(scanned);
+        return listing;
+    }
+
+    static void Save(std::string path) {
+        std::ofstream out{path, std::ios::binary | std::ios::trunc};
+        WriteValue(out, Version);
+        WriteValue(out, uint64_t(Cache_.size()));
+        for (auto& [unit, listing] : Cache_) {
+            WriteString(out, unit);
+            WriteValue(out, listing.Time);
+            WriteString(out, listing.Signature);
+            WriteValue(out, uint64_t(listing.Files.size()));
+            for (auto& file : listing.Files) {
+                WriteString(out, file.Name);
+                WriteValue(out, uint64_t(file.Size));
+            }
+        }
+    }
+
+    // A cache that fails any check is dropped as a whole, its units are
+    // scanned again and the next save replaces it.
+    static void Load(std::string path) {
+        // Smallest encodings: an empty unit and an empty file record.
+        constexpr uint64_t MinUnit = 3 * sizeof(uint64_t) + sizeof(int64_t);
+        constexpr uint64_t MinFile = 2 * sizeof(uint64_t);
+
+        std::error_code ec;
+        uint64_t end = fs::file_size(path, ec);
+        std::ifstream in{path, std::ios::binary};
+        uint32_t version;
+        uint64_t count;
+        if (ec || !ReadValue(in, version) || version != Version)
+            return;
+
+        std::unordered_map<std::string, Listing> loaded;
+        bool valid = ReadValue(in, count) && count <= Remaining(in, end) / MinUnit;
+        for (uint64_t i = 0; valid && i < count; i++) {
+            std::string unit;
+            Listing listing;
+            uint64_t files;
+            valid = ReadString(in, unit, end) && ReadValue(in, listing.Time) && ReadString(in, listing.Signature, end)
+                && ReadValue(in, files) && files <= Remaining(in, end) / MinFile;
+            if (valid)
+                listing.Files.reserve(files);
+            for (uint64_t f = 0; valid && f < files; f++) {
+                File file;
+                uint64_t size;
+                valid = ReadString(in, file.Name, end) && ReadValue(in, size);
+                file.Size = size;
+                listing.Files.push_back(std::move(file));
+            }
+            loaded[unit] = std::move(listing);
+        }
+        if (!valid) {
+            std::cout << "Discarding corrupt listing cache " << path << "\n";
+            return;
+        }
+
+        for (auto& [unit, listing] : loaded)
+            Cache_[unit] = std::move(listing);
+        std::cout << "Loaded " << Cache_.size() << " cached listings\n";
+    }
+
+    static void SetStorage(std::string path) {
+        Storage_ = path;
+        Load(path);
+    }
+
+    static void Persist() {
+        if (!Storage_.empty())
+            Save(Storage_);
+    }
+
+    static void Clear() {
+        Cache_.clear();
+    }
+};
+
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+
+    virtual void Add(const fs::path& from, const fs::path& name, const std::string& root) = 0;
+    // Returns the number of files that were not written, at least 1 when the
+    // output itself could not be written.
+    virtual size_t Finish() = 0;
+};
+
+// Append-only record of a folder compile: the plan, the listing of every
+// unit as it is planned, then every file once its data is on disk. Lines
+// only count once their newline is on disk, so a torn tail after a crash is
+// ignored. After a failed write nothing more is journaled.
+class CompileJournal {
+private:
+    constexpr const static size_t SyncEvery = 1024;
+
+    int Fd_{-1};
+    std::atomic<bool> Failed_{false};
+    std::mutex Lock_;
+    size_t Pending_{0};
+    std::chrono::steady_clock::time_point Synced_{};
+
+    void Append(const std::string& line) {
+        if (Fd_ == -1)
+            return;
+        auto data = line + '\n';
+        for (size_t done = 0; done < data.size();) {
+            auto r = ::write(Fd_, data.data() + done, data.size() - done);
+            if (r <= 0) {
+                Fail();
+                return;
+            }
+            done += r;
+        }
+        if (++Pending_ >= SyncEvery || std::chrono::steady_clock::now() - Synced_ > std::chrono::seconds{1})
+            Sync();
+    }
+
+    void Sync() {
+        if (Fd_ == -1)
+            return;
+        if (::fsync(Fd_) != 0) {
+            Fail();
+            return;
+        }
+        Pending_ = 0;
+        Synced_ = std::chrono::steady_clock::now();
+    }
+
+    void Fail() {
+        ::close(Fd_);
+        Fd_ = -1;
+        Failed_ = true;
+    }
+
+public:
+    inline static const std::string FileName = ".emerald-journal";
+    inline static const std::string Magic = "emerald-journal 1";
+
+    struct State {
+        std::vector<std::string> Plan;
+        std::vector<std::string> Units;
+        std::unordered_set<std::string> Written;
+        uintmax_t Length{0};
+        bool Complete{false};
+    };
+
+    static std::optional<State> Read(const fs::path& path) {
+        std::ifstream in{path};
+        std::string line;
+        if (!std::getline(in, line) || line != Magic)
+            return std::nullopt;
+
+        State res;
+        res.Length = in.tellg();
+        while (std::getline(in, line) && !in.eof()) {
+            res.Length = in.tellg();
+            auto split = line.find(' ');
+            auto kind = line.substr(0, split);
+            auto value = split == std::string::npos ? std::string{} : line.substr(split + 1);
+            if (kind == "plan")
+                res.Plan.push_back(value);
+            else if (kind == "unit")
+                res.Units.push_back(value);
+            else if (kind == "file")
+                res.Written.insert(value);
+            else if (kind == "complete")
+                res.Complete = true;
+        }
+        return res;
+    }
+
+    CompileJournal(const fs::path& path, const std::vector<std::string>& plan) {
+        Fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (Fd_ == -1) {
+            Failed_ = true;
+            return;
+        }
+        Append(Magic);
+        for (auto& line : plan)
+            Append("plan " + line);
+        Sync();
+    }
+
+    // Continues a journal after its last complete line.
+    CompileJournal(const fs::path& path, const State& state) {
+        Fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        if (Fd_ == -1)
+            Failed_ = true;
+        else if (::ftruncate(Fd_, state.Length) != 0)
+            Fail();
+    }
+
+    ~CompileJournal() {
+        if (Fd_ != -1) {
+            Sync();
+            ::close(Fd_);
+        }
+    }
+
+    bool Failed() const {
+        return Failed_;
+    }
+
+    void Unit(const std::string& line) {
+        std::lock_guard lock{Lock_};
+        if (Fd_ != -1)
+            Append("unit " + line);
+    }
+
+    // False once the journal failed, the compile should stop copying.
+    bool Written(const std::string& name) {
+        std::lock_guard lock{Lock_};
+        if (Fd_ != -1)
+            Append("file " + name);
+        return Fd_ != -1;
+    }
+
+    void Complete() {
+        std::lock_guard lock{Lock_};
+        if (Fd_ != -1) {
+            Append("complete");
+            Sync();
+        }
+    }
+};
+
+// Loose files in the output folder, copied by per root workers so a slow
+// disk only delays its own files.
+class DirectorySink : public OutputSink {
+private:
+    struct CopyJob {
+        fs::path From;
+        fs::path Name;
+    };
+
+    fs::path Output_;
+    std::map<std::string, std::vector<CopyJob>> Jobs_;
+    std::set<fs::path> Folders_;
+
+    static bool SyncData(const fs::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+#ifdef __APPLE__
+        bool res = ::fsync(fd) == 0;
+#else
+        bool res = ::fdatasync(fd) == 0;
+#endif
+        ::close(fd);
+        return res;
+    }
+
 public:
-    constexpr const static char AttributeSymbol = '@';
-    constexpr const static char AttributeValueSpacerSymbol = ':';
-    inline static const std::string UnitInitFile = "Unit.emerald";
+    // Copies are flushed to disk before they are journaled.
+    CompileJournal* Journal{nullptr};
+    // Set when resuming, files of an interrupted copy are overwritten.
+    bool Overwrite{false};
 
-    std::string Name;
-    std::string Path;
-    std::set<std::string> Tags;
+    DirectorySink(fs::path output) : Output_(output) {
+        fs::create_directories(Output_);
+    }
 
-    InnerSelector* FInSelector{nullptr};
-    Sorter* FSorter{nullptr};
-    OuterSelector* FOutSelector{nullptr};
-    Namer* FNamer{nullptr};
+    void Add(const fs::path& from, const fs::path& name, const std::string& root) {
+        auto folder = name.parent_path();
+        if (!folder.empty() && Folders_.insert(folder).second)
+            fs::create_directories(Output_/folder);
+        Jobs_[root].push_back(CopyJob{from, name});
+    }
 
-    EmeraldUnit() {}
-    EmeraldUnit(fs::path path) : Path(path) {
-        auto init_path = path/UnitInitFile;
-        if (fs::exists(init_path)) {
-            FromScript(init_path);
+    size_t Finish() {
+        std::atomic<size_t> written{0};
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> workers;
+        std::deque<std::atomic<size_t>> next(Jobs_.size());
+
+        size_t total = 0, index = 0;
+        for (auto& [root, list] : Jobs_) {
+            auto it = Emerald::Storage::Roots.find(root);
+            size_t concurrency = it == Emerald::Storage::Roots.end() ? 1 : it->second.CopyConcurrency;
+            for (size_t i = 0; i < std::min(concurrency, list.size()); i++) {
+                workers.emplace_back([this, &list = list, &next = next[index], &written, &stop] {
+                    auto options = Overwrite ? fs::copy_options::overwrite_existing : fs::copy_options::none;
+                    for (size_t job; !stop && (job = next++) < list.size();) {
+                        std::error_code ec;
+                        auto to = Output_/list[job].Name;
+                        fs::copy(list[job].From, to, options, ec);
+                        if (ec || (Journal != nullptr && !SyncData(to)))
+                            continue;
+                        if (Journal != nullptr && !Journal->Written(list[job].Name.string()))
+                            stop = true;
+                        else
+                            written++;
+                    }
+                });
+            }
+            total += list.size();
+            index++;
         }
-    }
+        for (auto& worker : workers)
+            worker.join();
 
-    static bool IsUnit(fs::path path) {
-        return fs::exists(path/UnitInitFile);
+        size_t failed = total - written;
+        if (failed != 0)
+            std::cout << "Failed to copy " << failed << " files" << std::endl;
+        return failed;
     }
+};
 
-    void init_mappings(echolang::echo_mapping* map) {
-        map->mappings["Name"] = echolang::echo_field{Name};
-        {
-            auto tag = echolang::echo_set_field{Tags};
-            tag.mappings["ContainsAttribute"] = echolang::echo_single_shot{echo_lambda(&) { 
-                return ContainsAttribute(row.value);
-            }};
-            map->mappings["Tags"] = tag;
-        }
-        {
-            auto obj = echolang::echo_object<InnerSelector>{this->FInSelector};
-            for (auto& i : EmeraldInit<InnerSelector>::Inits)
-                obj.inits[i.first]=i.second;
-            map->mappings["InnerSelector"] = obj;
+// Base of the single file sinks: one buffered output stream and a reusable
+// read buffer, files are appended in the order they are added.
+class ArchiveSink : public OutputSink {
+protected:
+    constexpr const static size_t BufferSize = 4 << 20;
+
+    std::FILE* Out_{nullptr};
+    std::vector<char> Buffer_;
+    std::vector<char> OutBuffer_;
+    fs::path Path_;
+    size_t Failed_{0};
+    // Set by the first short write or failed seek, nothing is written after it.
+    bool WriteFailed_{false};
+
+    struct Source {
+        int fd{-1};
+        uint64_t size{0};
+        time_t time{0};
+
+        ~Source() {
+            if (fd != -1)
+                ::close(fd);
         }
-        {
-            auto obj = echolang::echo_object<Sorter>{this->FSorter};
-            for (auto& i : EmeraldInit<Sorter>::Inits)
-                obj.inits[i.first]=i.second;
-            map->mappings["Sorter"] = obj;
+    };
+
+    bool Open(const fs::path& from, Source& src) {
+        src.fd = ::open(from.c_str(), O_RDONLY);
+        struct stat st;
+        if (src.fd == -1 || ::fstat(src.fd, &st) != 0) {
+            Failed_++;
+            return false;
         }
-        {
-            auto obj = echolang::echo_object<OuterSelector>{this->FOutSelector};
-            for (auto& i : EmeraldInit<OuterSelector>::Inits)
-                obj.inits[i.first]=i.second;
-            map->mappings["OuterSelector"] = obj;
+        src.size = st.st_size;
+        src.time = st.st_mtime;
+        return true;
+    }
+
+    // Reads up to the buffer size; a short file is padded with zeros so the
+    // entry keeps the size already written to its header.
+    size_t Read(Source& src, uint64_t left) {
+        size_t want = std::min<uint64_t>(left, Buffer_.size());
+        size_t got = 0;
+        while (got < want) {
+            auto r = ::read(src.fd, Buffer_.data() + got, want - got);
+            if (r <= 0)
+                break;
+            got += r;
         }
-        {
-            auto obj = echolang::echo_object<Namer>{this->FNamer};
-            for (auto& i : EmeraldInit<Namer>::Inits)
-                obj.inits[i.first]=i.second;
-            map->mappings["Namer"] = obj;
+        if (got < want) {
+            std::fill(Buffer_.begin() + got, Buffer_.begin() + want, 0);
+            Failed_++;
         }
+        return want;
     }
 
-    static EmeraldUnit* CreateEmpty() {
-        return new EmeraldUnit();
+    void Write(const void* data, size_t size) {
+        if (!WriteFailed_ && std::fwrite(data, 1, size, Out_) != size)
+            WriteFailed_ = true;
     }
 
-    void FromScript(fs::path file) {
-        auto sc = std::make_shared<echolang::echo_script>();
-        sc->from_file(file);
-
-        auto map = echolang::echo_mapping::create_default_controls();
-        init_mappings(&map);
+    void Seek(uint64_t offset) {
+        if (!WriteFailed_ && fseeko(Out_, offset, SEEK_SET) != 0)
+            WriteFailed_ = true;
+    }
 
-        echolang::executor exec{sc, map};
-        exec.run();
+    template<typename T>
+    void WriteLE(T value) {
+        unsigned char bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); i++)
+            bytes[i] = (uint64_t(value) >> (8 * i)) & 0xFF;
+        Write(bytes, sizeof(T));
     }
 
-    bool ContainsAttribute(const std::string& name) const {
-        auto it = Tags.lower_bound(AttributeSymbol + name + AttributeValueSpacerSymbol);
+    ArchiveSink(fs::path path) : Buffer_(BufferSize), OutBuffer_(BufferSize), Path_(path) {
+        std::error_code ec;
+        fs::create_directories(path.parent_path(), ec);
+        Out_ = std::fopen(path.c_str(), "wb");
+        if (Out_ == nullptr)
+            std::cout << "Failed to create " << path << std::endl;
+        else
+            std::setvbuf(Out_, OutBuffer_.data(), _IOFBF, OutBuffer_.size());
+    }
 
-        if (it == Tags.end())
-            return false;
+    size_t Close() {
+        if (Out_ == nullptr)
+            return WriteFailed_ ? std::max<size_t>(Failed_, 1) : Failed_;
+        if (std::fclose(Out_) != 0)
+            WriteFailed_ = true;
+        Out_ = nullptr;
+        if (WriteFailed_)
+            std::cout << "Failed to write " << Path_ << ", the archive is incomplete" << std::endl;
+        if (Failed_ != 0)
+            std::cout << "Failed to archive " << Failed_ << " files" << std::endl;
+        return WriteFailed_ ? std::max<size_t>(Failed_, 1) : Failed_;
+    }
 
-        return IsAttribute(name, *it);
+public:
+    ~ArchiveSink() {
+        Close();
     }
+};
 
-    const std::string& GetAttribute(const std::string& name) const {
-        return *Tags.lower_bound(AttributeSymbol + name + AttributeValueSpacerSymbol);
+// Uncompressed POSIX ustar archive, names longer than ustar allows use GNU
+// long name records.
+class TarSink : public ArchiveSink {
+private:
+    static void Octal(char* field, size_t width, uint64_t value) {
+        if (value >> (3 * (width - 1))) {
+            field[0] = char(0x80);
+            for (size_t i = width - 1; i > 0; i--) {
+                field[i] = char(value & 0xFF);
+                value >>= 8;
+            }
+            return;
+        }
+        std::snprintf(field, width, "%0*llo", int(width - 1), (unsigned long long)value);
     }
 
-    static bool IsValuedAttribute(const std::string& attr) {
-        return attr.find(AttributeValueSpacerSymbol) != std::string::npos;
+    void Header(const std::string& name, const std::string& prefix, uint64_t size, time_t time, char type) {
+        char header[512] = {};
+        std::memcpy(header, name.data(), std::min<size_t>(name.size(), 100));
+        Octal(header + 100, 8, 0644);
+        Octal(header + 108, 8, 0);
+        Octal(header + 116, 8, 0);
+        Octal(header + 124, 12, size);
+        Octal(header + 136, 12, time);
+        header[156] = type;
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+        std::memcpy(header + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+
+        std::memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (auto c : header)
+            sum += (unsigned char)c;
+        std::snprintf(header + 148, 8, "%06o", sum);
+        header[155] = ' ';
+        Write(header, sizeof(header));
     }
 
-    static std::string ValueFromAttribute(const std::string& attr) {
-        return attr.substr(attr.find(AttributeValueSpacerSymbol));
+    void Pad(uint64_t size) {
+        static const char zero[512] = {};
+        if (size % 512 != 0)
+            Write(zero, 512 - size % 512);
     }
 
-    void SetAttribute(const std::string& name, std::string&& value) {
-        if (ContainsAttribute(name))
-            Tags.erase(GetAttribute(name));
+public:
+    TarSink(fs::path path) : ArchiveSink(path) {}
+
+    void Add(const fs::path& from, const fs::path& name, const std::string& root) {
+        Source src;
+        if (Out_ == nullptr || WriteFailed_ || !Open(from, src))
+            return;
+
+        auto entry = name.generic_string();
+        std::string prefix;
+        if (entry.size() > 100) {
+            auto split = entry.find('/', entry.size() - 101);
+            if (split != std::string::npos && split <= 155 && entry.size() - split - 1 <= 100) {
+                prefix = entry.substr(0, split);
+                entry = entry.substr(split + 1);
+            } else {
+                Header("././@LongLink", "", entry.size() + 1, 0, 'L');
+                Write(entry.c_str(), entry.size() + 1);
+                Pad(entry.size() + 1);
+            }
+        }
 
-        Tags.emplace(AttributeSymbol + name + AttributeValueSpacerSymbol + value);
+        Header(entry, prefix, src.size, src.time, '0');
+        for (uint64_t left = src.size; left > 0;) {
+            auto size = Read(src, left);
+            Write(Buffer_.data(), size);
+            left -= size;
+        }
+        Pad(src.size);
     }
 
-    ~EmeraldUnit() {
+    size_t Finish() {
+        if (Out_ == nullptr)
+            return Failed_ + 1;
+        static const char zero[1024] = {};
+        Write(zero, sizeof(zero));
+        return Close();
     }
 };
 
-struct Emerald::Storage {
-    inline static std::vector<EmeraldUnit> Units{};
+// Store-only zip with zip64 records when sizes, offsets or the entry count
+// do not fit the classic format.
+class ZipSink : public ArchiveSink {
+private:
+    constexpr const static uint32_t Limit32 = 0xFFFFFFFF;
+
+    struct Entry {
+        std::string name;
+        uint32_t crc;
+        uint64_t size;
+        uint64_t offset;
+        uint16_t time;
+        uint16_t date;
+    };
 
-    inline static fs::path StashPath;
+    std::vector<Entry> Entries_;
 
-    static void SetStashPath(std::string path) {
-        StashPath = path;
+    static uint32_t Crc(uint32_t crc, const char* data, size_t size) {
+        static const auto table = [] {
+            std::array<uint32_t, 256> res;
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                res[i] = c;
+            }
+            return res;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
     }
 
-    static void LoadUnit(std::string path) {
-        if (EmeraldUnit::IsUnit(StashPath/path))
-            Units.push_back(EmeraldUnit{StashPath/path});
+    static void DosTime(time_t time, uint16_t& dos_time, uint16_t& dos_date) {
+        std::tm tm{};
+        localtime_r(&time, &tm);
+        if (tm.tm_year < 80) {
+            dos_time = 0;
+            dos_date = (1 << 5) | 1;
+            return;
+        }
+        dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+        dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
     }
 
-    static void ListTags() {
-        std::map<std::string, size_t> tags;
-
-        for (auto unit : Units) {
-            for (auto tag : unit.Tags) {
-                if (tag[0] != EmeraldUnit::AttributeSymbol)
-                    tags[tag]++;
-            }
+    void LocalHeader(const Entry& e) {
+        bool zip64 = e.size >= Limit32;
+        WriteLE<uint32_t>(0x04034b50);
+        WriteLE<uint16_t>(zip64 ? 45 : 20);
+        WriteLE<uint16_t>(0x0800);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint16_t>(e.time);
+        WriteLE<uint16_t>(e.date);
+        WriteLE<uint32_t>(e.crc);
+        WriteLE<uint32_t>(zip64 ? Limit32 : e.size);
+        WriteLE<uint32_t>(zip64 ? Limit32 : e.size);
+        WriteLE<uint16_t>(e.name.size());
+        WriteLE<uint16_t>(zip64 ? 20 : 0);
+        Write(e.name.data(), e.name.size());
+        if (zip64) {
+            WriteLE<uint16_t>(1);
+            WriteLE<uint16_t>(16);
+            WriteLE<uint64_t>(e.size);
+            WriteLE<uint64_t>(e.size);
         }
+    }
 
-        for (auto tag : tags) {
-            std::cout << std::setw(10) << tag.first << ": " << tag.second << std::endl;
+    void CentralHeader(const Entry& e) {
+        bool big = e.size >= Limit32;
+        bool far = e.offset >= Limit32;
+        uint16_t extra = (big ? 16 : 0) + (far ? 8 : 0);
+        WriteLE<uint32_t>(0x02014b50);
+        WriteLE<uint16_t>((3 << 8) | 45);
+        WriteLE<uint16_t>(big || far ? 45 : 20);
+        WriteLE<uint16_t>(0x0800);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint16_t>(e.time);
+        WriteLE<uint16_t>(e.date);
+        WriteLE<uint32_t>(e.crc);
+        WriteLE<uint32_t>(big ? Limit32 : e.size);
+        WriteLE<uint32_t>(big ? Limit32 : e.size);
+        WriteLE<uint16_t>(e.name.size());
+        WriteLE<uint16_t>(extra ? extra + 4 : 0);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint32_t>(0100644u << 16);
+        WriteLE<uint32_t>(far ? Limit32 : e.offset);
+        Write(e.name.data(), e.name.size());
+        if (extra) {
+            WriteLE<uint16_t>(1);
+            WriteLE<uint16_t>(extra);
+            if (big) {
+                WriteLE<uint64_t>(e.size);
+                WriteLE<uint64_t>(e.size);
+            }
+            if (far)
+                WriteLE<uint64_t>(e.offset);
         }
     }
 
-    static void LoadUnitsFrom(std::string path) {
-        std::cout << "Loading units from: " << StashPath/path << std::endl;
-        for (auto entry : fs::directory_iterator{StashPath/path}) {
-            if (entry.is_directory()) {
-                LoadUnit(fs::relative(entry.path(), StashPath).string());
+public:
+    ZipSink(fs::path path) : ArchiveSink(path) {}
+
+    // Files that fit the buffer are read before their header, so the CRC is
+    // known up front; bigger ones get their CRC patched in afterwards.
+    void Add(const fs::path& from, const fs::path& name, const std::string& root) {
+        Source src;
+        if (Out_ == nullptr || WriteFailed_ || !Open(from, src))
+            return;
+
+        Entry e{name.generic_string(), 0, src.size, uint64_t(ftello(Out_)), 0, 0};
+        DosTime(src.time, e.time, e.date);
+
+        if (src.size <= Buffer_.size()) {
+            auto size = Read(src, src.size);
+            e.crc = Crc(0, Buffer_.data(), size);
+            LocalHeader(e);
+            Write(Buffer_.data(), size);
+        } else {
+            LocalHeader(e);
+            for (uint64_t left = src.size; left > 0;) {
+                auto size = Read(src, left);
+                e.crc = Crc(e.crc, Buffer_.data(), size);
+                Write(Buffer_.data(), size);
+                left -= size;
             }
+            auto end = ftello(Out_);
+            Seek(e.offset + 14);
+            WriteLE<uint32_t>(e.crc);
+            Seek(end);
         }
+        Entries_.push_back(std::move(e));
     }
 
-    static void SetupStorageMappings(echolang::echo_mapping* mapping) {
-        mapping->mappings["LoadUnit"] = echolang::echo_bind_function(LoadUnit);
-        mapping->mappings["LoadUnitsFrom"] = echolang::echo_bind_function(LoadUnitsFrom);
-        mapping->mappings["SetStashPath"] = echolang::echo_bind_function(SetStashPath);
-        mapping->mappings["ListTags"] = echolang::echo_bind_function(ListTags);
+    size_t Finish() {
+        if (Out_ == nullptr)
+            return Failed_ + 1;
+
+        uint64_t begin = ftello(Out_);
+        for (auto& e : Entries_)
+            CentralHeader(e);
+        uint64_t end = ftello(Out_);
+        uint64_t size = end - begin;
+        uint64_t count = Entries_.size();
+
+        if (count >= 0xFFFF || size >= Limit32 || begin >= Limit32) {
+            WriteLE<uint32_t>(0x06064b50);
+            WriteLE<uint64_t>(44);
+            WriteLE<uint16_t>((3 << 8) | 45);
+            WriteLE<uint16_t>(45);
+            WriteLE<uint32_t>(0);
+            WriteLE<uint32_t>(0);
+            WriteLE<uint64_t>(count);
+            WriteLE<uint64_t>(count);
+            WriteLE<uint64_t>(size);
+            WriteLE<uint64_t>(begin);
+
+            WriteLE<uint32_t>(0x07064b50);
+            WriteLE<uint32_t>(0);
+            WriteLE<uint64_t>(end);
+            WriteLE<uint32_t>(1);
+        }
+
+        WriteLE<uint32_t>(0x06054b50);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint16_t>(0);
+        WriteLE<uint16_t>(std::min<uint64_t>(count, 0xFFFF));
+        WriteLE<uint16_t>(std::min<uint64_t>(count, 0xFFFF));
+        WriteLE<uint32_t>(std::min<uint64_t>(size, Limit32));
+        WriteLE<uint32_t>(std::min<uint64_t>(begin, Limit32));
+        WriteLE<uint16_t>(0);
+        return Close();
     }
 };
 
 struct Emerald::Compile {
     inline static fs::path Output{"Output"};
 
+    inline static std::string OutputIndex{};
+
+    inline static std::string Sink{"folder"};
+
+    static fs::path ArchivePath() {
+        auto path = Emerald::Storage::StashPath/Output;
+        path += "." + Sink;
+        return path;
+    }
+
+    static std::unique_ptr<OutputSink> MakeSink() {
+        if (Sink == "tar")
+            return std::make_unique<TarSink>(ArchivePath());
+        if (Sink == "zip")
+            return std::make_unique<ZipSink>(ArchivePath());
+        return std::make_unique<DirectorySink>(Emerald::Storage::StashPath/Output);
+    }
+
+    static void SetOutputSink(std::string sink) {
+        if (sink != "folder" && sink != "tar" && sink != "zip") {
+            std::cout << "Unknown output sink: " << sink << std::endl;
+            return;
+        }
+        Sink = sink;
+    }
+
     inline static std::vector<EmeraldUnit*> Targets;
 
+    inline static std::map<std::string, std::vector<EmeraldUnit*>> Collections;
+
+    inline static TagQueryBatch Batch{};
+
+    // The folder or archive is created by the sink at compile time.
     static void SetOutputPath(std::string path) {
         Output = path;
-        if (!fs::exists(Emerald::Storage::StashPath/Output))
-            fs::create_directory(Emerald::Storage::StashPath/Output);
     }
 
     static void GenerateFreeOutputFolder() {
@@ -348,26 +2009,184 @@ struct Emerald::Compile {
         fs::create_directory(Emerald::Storage::StashPath/Output);
     }
 
+    // Parsed request that can be checked against single units; attribute
+    // predicates are resolved through the index once, up front.
+    struct UnitRequest {
+    private:
+        std::vector<std::string> Script_;
+        std::map<std::string, std::vector<bool>> Predicates_;
+        const EmeraldUnit* Unit_{nullptr};
+        size_t Index_{0};
+        TagChecker Checker_{[this](std::string tag) {
+            if (!Predicates_.empty()) {
+                auto it = Predicates_.find(tag);
+                if (it != Predicates_.end())
+                    return bool(it->second[Index_]);
+            }
+            return Unit_->Tags.contains(tag);
+        }};
+
+    public:
+        UnitRequest(const std::string& request) : Script_(TagChecker::parse(request)) {
+            for (auto& term : Script_) {
+                if (auto pred = AttributePredicate::Parse(term))
+                    Predicates_.emplace(term, Emerald::Storage::Attributes().MatchMask(*pred, Emerald::Storage::Units.size()));
+                else if (TagDictionary::IsPattern(term))
+                    Predicates_.emplace(term, Emerald::Storage::Dictionary().MatchMask(term, Emerald::Storage::Units.size()));
+            }
+        }
+
+        UnitRequest(const UnitRequest&) = delete;
+        UnitRequest& operator=(const UnitRequest&) = delete;
+
+        bool Check(const EmeraldUnit& unit, size_t index) {
+            Unit_ = &unit;
+            Index_ = index;
+            return Checker_.check(Script_);
+        }
+    };
+
+    static size_t SelectInto(std::string request, std::vector<EmeraldUnit*>& out, size_t limit = -1) {
+        auto osize = out.size();
+        UnitRequest checker{request};
+        size_t index = 0;
+        for (auto& i : Emerald::Storage::Units) {
+            if (out.size() - osize >= limit)
+                break;
+            if (checker.Check(i, index++))
+                out.push_back(&i);
+        }
+        return out.size() - osize;
+    }
+
+    static size_t SampleInto(std::string request, size_t count, uint64_t seed, std::vector<EmeraldUnit*>& out) {
+        UnitRequest checker{request};
+        std::mt19937_64 random{seed};
+        std::vector<EmeraldUnit*> reservoir;
+        reservoir.reserve(count);
+
+        size_t index = 0;
+        size_t seen = 0;
+        for (auto& i : Emerald::Storage::Units) {
+            if (!checker.Check(i, index++))
+                continue;
+            if (reservoir.size() < count) {
+                reservoir.push_back(&i);
+            } else {
+                auto j = std::uniform_int_distribution<size_t>{0, seen}(random);
+                if (j < count)
+                    reservoir[j] = &i;
+            }
+            seen++;
+        }
+
+        out.insert(out.end(), reservoir.begin(), reservoir.end());
+        return reservoir.size();
+    }
+
+    // Walks the attribute index from the highest value down and stops after
+    // count matches, so the match set is never materialized.
+    static size_t TopInto(std::string request, size_t count, const std::string& attribute, std::vector<EmeraldUnit*>& out) {
+        auto& index = Emerald::Storage::Attributes();
+        auto values = index.Values(attribute, false);
+        if (values == nullptr)
+            values = index.Values(attribute, true);
+        if (values == nullptr)
+            return 0;
+
+        UnitRequest checker{request};
+        size_t selected = 0;
+        for (auto i = values->rbegin(); i != values->rend() && selected < count; i++) {
+            auto& unit = Emerald::Storage::Units[i->second];
+            if (checker.Check(unit, i->second)) {
+                out.push_back(&unit);
+                selected++;
+            }
+        }
+        return selected;
+    }
+
+    static std::pair<std::string, std::string> SplitWord(const std::string& str) {
+        auto split = str.find(' ');
+        if (split == std::string::npos)
+            return {str, ""};
+        return {str.substr(0, split), str.substr(split + 1)};
+    }
+
+    static void SelectFirst(std::string args) {
+        auto [count, request] = SplitWord(args);
+        std::cout << "Selected " << SelectInto(request, Targets, std::stoull(count)) << " targets.\n";
+    }
+
+    static void SelectSample(std::string args) {
+        auto [count, rest] = SplitWord(args);
+        auto [seed, request] = SplitWord(rest);
+        std::cout << "Selected " << SampleInto(request, std::stoull(count), std::stoull(seed), Targets) << " targets.\n";
+    }
+
+    static void SelectTop(std::string args) {
+        auto [count, rest] = SplitWord(args);
+        auto [attribute, request] = SplitWord(rest);
+        std::cout << "Selected " << TopInto(request, std::stoull(count), attribute, Targets) << " targets.\n";
+    }
+
     static bool Select() {
         std::cout << "Input polish notation request:\n";
         std::string a;
-        auto osize = Targets.size();
         std::getline(std::cin, a);
         if (a == "stop")
             return false;
-        EmeraldUnit* trg;
-        auto check = [&trg](std::string tag) { return trg->Tags.contains(tag); };
-        TagChecker checker{check};
-        auto scr = checker.parse(a);
-        for (auto& i : Emerald::Storage::Units) {
-            trg = &i;
-            if (checker.check(scr))
-                Targets.push_back(&i);
-        }
-        std::cout << "Selected " << Targets.size() - osize << " targets.\n";
+        std::cout << "Selected " << SelectInto(a, Targets) << " targets.\n";
         return true;
     }
 
+    static void BatchQuery(std::string line) {
+        auto split = line.find(' ');
+        if (split == std::string::npos || !Batch.add(line.substr(0, split), line.substr(split + 1)))
+            std::cout << "Bad batch request: " << line << std::endl;
+    }
+
+    static void BatchSelect(std::string path) {
+        if (!path.empty()) {
+            std::ifstream file{path};
+            std::string line;
+            while (std::getline(file, line)) {
+                if (!line.empty() && line[0] != '#')
+                    BatchQuery(line);
+            }
+        }
+
+        std::cout << "Batch of " << Batch.size() << " requests (" << Batch.nodes() << " distinct subexpressions)\n";
+        for (auto& [name, units] : Batch.run(Emerald::Storage::Units, &Emerald::Storage::Attributes(), &Emerald::Storage::Dictionary())) {
+            std::cout << "\t" << name << ": " << units.size() << " targets\n";
+            Collections[name] = std::move(units);
+        }
+        Batch = TagQueryBatch{};
+    }
+
+    static void UseCollection(std::string name) {
+        auto it = Collections.find(name);
+        if (it == Collections.end()) {
+            std::cout << "No collection " << name << std::endl;
+            return;
+        }
+        Targets.insert(Targets.end(), it->second.begin(), it->second.end());
+        std::cout << "Selected " << it->second.size() << " targets from " << name << ".\n";
+    }
+
+    static void CompileCollections() {
+        auto targets = std::move(Targets);
+        auto output = Output;
+        for (auto& [name, units] : Collections) {
+            std::cout << "Collection " << name << std::endl;
+            Targets = units;
+            SetOutputPath(name);
+            CompileOutput();
+        }
+        Targets = std::move(targets);
+        Output = output;
+    }
+
     static void RemoveSame() {
         std::sort(Targets.begin(), Targets.end());
         int j = 0;
@@ -389,6 +2208,16 @@ struct Emerald::Compile {
     }
 
     static void ClearOutput() {
+        if (Sink != "folder") {
+            std::cout << "Clearing output " << ArchivePath() << "\n";
+            fs::remove(ArchivePath());
+            if (!OutputIndex.empty())
+                fs::remove(ArchivePath().string() + "." + OutputIndex);
+            return;
+        }
+        if (!fs::is_directory(Emerald::Storage::StashPath/Output))
+            return;
+
         size_t totalFiles = std::distance(fs::directory_iterator{Emerald::Storage::StashPath/Output}, fs::directory_iterator{});
         std::cout << "Clearing output(" << totalFiles << ")\n";
 
@@ -396,7 +2225,7 @@ struct Emerald::Compile {
         size_t p = 0;
         size_t iterations = (totalFiles + 99) / 100;
         for(auto i : fs::directory_iterator{Emerald::Storage::StashPath/Output}) {
-            fs::remove(i.path());
+            fs::remove_all(i.path());
             files++;
             if(files * iterations/totalFiles > p) {
                 p = files * iterations/totalFiles;
@@ -406,16 +2235,106 @@ struct Emerald::Compile {
         }
     }
 
+    static void SetOutputLayout(std::string spec) {
+        if (!OutputLayout::Parse(spec, OutputLayout::Current()))
+            std::cout << "Unknown output layout: " << spec << std::endl;
+    }
+
+    static void SetOutputIndex(std::string name) {
+        OutputIndex = name;
+    }
+
+    // Everything that decides which files are written and how they are named,
+    // except the unit listings which are journaled as they are made.
+    static std::vector<std::string> Plan() {
+        auto& layout = OutputLayout::Current();
+        std::vector<std::string> plan{
+            "layout " + std::to_string(int(layout.LayoutMode)) + ' ' + std::to_string(layout.Width),
+            "output-index " + OutputIndex,
+        };
+        for (auto unit : Targets) {
+            unit->Stage();
+            plan.push_back(unit->Path + '\t' + unit->FInSelector->Signature() + '|' + unit->FSorter->Signature() + '|'
+                + unit->FOutSelector->Signature() + '|' + unit->FNamer->Signature());
+        }
+        return plan;
+    }
+
+    // Calls emit(file, index, name) for every file the outer selector keeps.
+    // Defined after the built-in stages, which it runs without virtual calls.
+    template<typename Emit>
+    static void NameFiles_(EmeraldUnit& unit, const std::vector<Emerald::Listings::File>& files, Emit emit);
+
     static void CompileOutput() {
-        auto output_path = Emerald::Storage::StashPath/Output;
+        CompileTargets(nullptr);
+    }
+
+    // Replays the interrupted compile so every namer sees the same sequence of
+    // files and produces the same names, but copies only what is missing.
+    static void Resume() {
+        if (Sink != "folder") {
+            std::cout << "Only folder output can be resumed" << std::endl;
+            return;
+        }
+
+        auto journal_path = Emerald::Storage::StashPath/Output/CompileJournal::FileName;
+        auto state = CompileJournal::Read(journal_path);
+        if (!state) {
+            std::cout << "No compile journal in " << Emerald::Storage::StashPath/Output << std::endl;
+            return;
+        }
+        if (state->Complete) {
+            std::cout << "Nothing to resume, the last compile completed" << std::endl;
+            return;
+        }
 
         EmeraldStatic::Init();
+        if (Plan() != state->Plan) {
+            std::cout << "Targets or stage configuration differ from the journal" << std::endl;
+            return;
+        }
+        std::cout << "Resuming with " << state->Written.size() << " files already written" << std::endl;
+        CompileTargets(&*state);
+    }
+
+    static void CompileTargets(const CompileJournal::State* resume, std::istream& input = std::cin) {
+        auto output_path = Emerald::Storage::StashPath/Output;
+
+        if (resume == nullptr)
+            EmeraldStatic::Init(input);
+        // Lazy units print their stage blocks here rather than between progress lines.
+        for (auto unit : Targets)
+            unit->Stage();
 
         size_t totalUnits = Targets.size();
         size_t units = 0;
 
         std::cout << "Compiling " << Targets.size() << " targets" << std::endl;
 
+        auto sink = MakeSink();
+        auto folder = dynamic_cast<DirectorySink*>(sink.get());
+
+        auto index_path = Sink == "folder" ? output_path/OutputIndex : fs::path{ArchivePath().string() + "." + OutputIndex};
+
+        std::unique_ptr<CompileJournal> journal;
+        if (folder != nullptr) {
+            auto journal_path = output_path/CompileJournal::FileName;
+            journal = resume ? std::make_unique<CompileJournal>(journal_path, *resume) : std::make_unique<CompileJournal>(journal_path, Plan());
+            folder->Journal = journal.get();
+            folder->Overwrite = resume != nullptr;
+            if (journal->Failed()) {
+                std::cout << "Failed to write the compile journal, compile aborted" << std::endl;
+                return;
+            }
+        }
+
+        uintmax_t bytes = 0;
+        size_t ordinal = 0, skipped = 0;
+        // A resume names every file again, so the index is always rewritten.
+        std::ofstream index_file;
+        if (!OutputIndex.empty())
+            index_file.open(index_path, std::ios::trunc);
+
         for (auto unit : Targets) {
             std::cout << "\t" << (++units) * 100 / totalUnits << "% Done\033[100D";
             std::cout.flush();
@@ -424,39 +2343,262 @@ struct Emerald::Compile {
             unit->FSorter->CompilationMsg(CompilationRound::SwapSource, *unit);
             unit->FOutSelector->CompilationMsg(CompilationRound::SwapSource, *unit);
             unit->FNamer->CompilationMsg(CompilationRound::SwapSource, *unit);
-            std::vector<fs::path> files;
-            for (auto file : fs::directory_iterator(Emerald::Storage::StashPath/unit->Path)) {
-                if (unit->FInSelector->Satisfies(file))
-                    files.push_back(file.path());
+            auto& listing = Emerald::Listings::Get(*unit);
+            auto& files = listing.Files;
+
+            if (journal) {
+                auto line = unit->Path + '\t' + std::to_string(files.size()) + '\t' + std::to_string(listing.Time);
+                if (resume == nullptr || units > resume->Units.size()) {
+                    journal->Unit(line);
+                    if (journal->Failed()) {
+                        std::cout << "\nFailed to write the compile journal, compile aborted" << std::endl;
+                        return;
+                    }
+                } else if (resume->Units[units - 1] != line) {
+                    std::cout << "\nUnit changed since the interrupted compile: " << unit->Path << std::endl;
+                    if (index_file.is_open()) {
+                        index_file.close();
+                        fs::resize_file(index_path, 0);
+                    }
+                    return;
+                }
             }
-            auto comp = [&unit](const fs::path& a, const fs::path& b) {
-                return unit->FSorter->PathLessCompare(a, b);
-            };
-            std::sort(files.begin(), files.end(), comp);
 
-            for (int index = 0; index < files.size(); index++) {
-                if (unit->FOutSelector->Satisfies(files[index], index, *unit)) {
-                    auto name = unit->FNamer->MakeName(files[index], index, *unit);
+            NameFiles_(*unit, files, [&](const fs::path& file, size_t index, const std::string& name) {
+                auto relative = unit->FNamer->MakeShard(name, ordinal++, *unit)/name;
+                if (index_file.is_open())
+                    index_file << name << '\t' << relative.string() << '\n';
 
-                    auto destenation = output_path/name;
-
-                    fs::copy(files[index], destenation);
+                if (resume != nullptr && resume->Written.count(relative.string()) != 0) {
+                    skipped++;
+                    return;
                 }
-            }
+                sink->Add(file, relative, unit->Root);
+                bytes += files[index].Size;
+            });
         }
+
+        std::cout << "Writing " << bytes << " bytes (listings: " << Emerald::Listings::Hits << " cached, " << Emerald::Listings::Misses << " scanned)" << std::endl;
+        if (skipped != 0)
+            std::cout << "Skipped " << skipped << " files written before the interruption" << std::endl;
+        Emerald::Listings::Persist();
+        size_t failed = sink->Finish();
+        if (journal && failed == 0)
+            journal->Complete();
+        if (journal && journal->Failed())
+            std::cout << "Failed to write the compile journal, compile aborted" << std::endl;
     }
 
     static void SetupCompileMappings(echolang::echo_mapping* mapping) {
         mapping->mappings["CompileOutput"] = echolang::echo_bind_function(CompileOutput);
+        mapping->mappings["Resume"] = echolang::echo_bind_function(Resume);
+        mapping->mappings["SetListingCache"] = echolang::echo_bind_function(Emerald::Listings::SetStorage);
+        mapping->mappings["SaveListings"] = echolang::echo_bind_function(Emerald::Listings::Save);
+        mapping->mappings["ClearListings"] = echolang::echo_bind_function(Emerald::Listings::Clear);
         mapping->mappings["ClearOutput"] = echolang::echo_bind_function(ClearOutput);
         mapping->mappings["ClearTargets"] = echolang::echo_bind_function(ClearTargets);
         mapping->mappings["RemoveSame"] = echolang::echo_bind_function(RemoveSame);
         mapping->mappings["Select"] = echolang::echo_bind_function(Select);
+        mapping->mappings["SelectFirst"] = echolang::echo_bind_function(SelectFirst);
+        mapping->mappings["SelectSample"] = echolang::echo_bind_function(SelectSample);
+        mapping->mappings["SelectTop"] = echolang::echo_bind_function(SelectTop);
+        mapping->mappings["BatchQuery"] = echolang::echo_bind_function(BatchQuery);
+        mapping->mappings["BatchSelect"] = echolang::echo_bind_function(BatchSelect);
+        mapping->mappings["UseCollection"] = echolang::echo_bind_function(UseCollection);
+        mapping->mappings["CompileCollections"] = echolang::echo_bind_function(CompileCollections);
         mapping->mappings["SetOutputPath"] = echolang::echo_bind_function(SetOutputPath);
+        mapping->mappings["SetOutputLayout"] = echolang::echo_bind_function(SetOutputLayout);
+        mapping->mappings["SetOutputIndex"] = echolang::echo_bind_function(SetOutputIndex);
+        mapping->mappings["SetOutputSink"] = echolang::echo_bind_function(SetOutputSink);
         mapping->mappings["GenerateFreeOutputFolder"] = echolang::echo_bind_function(GenerateFreeOutputFolder);
     }
 };
 
+// Line based protocol, one command per line, every reply ends with an
+// "ok ..." or "error ..." line:
+//   select <polish request>          - matching units, <root>:<path> for
+//                                      units of a root, stash paths otherwise
+//   tags                             - "<tag> <count>" lines
+//   compile <output> <polish request> [-- <outer request>]
+//                                    - compile selection into output folder,
+//                                      the outer request answers the tagged
+//                                      outer selector instead of the console
+//   reload <unit>                    - reload a unit named as select prints it
+//   stop                             - stop serving
+struct Emerald::Daemon {
+private:
+    inline static std::mutex CompileLock_{};
+    inline static std::mutex ClientsLock_{};
+    inline static std::condition_variable ClientsDone_{};
+    inline static std::set<int> Clients_{};
+    inline static int Socket_{-1};
+
+    static void Select(const std::string& request, std::ostream& out) {
+        std::shared_lock lock{Emerald::Storage::Lock};
+        std::vector<EmeraldUnit*> units;
+        Emerald::Compile::SelectInto(request, units);
+        for (auto unit : units)
+            out << Emerald::Storage::UnitId(*unit) << '\n';
+        out << "ok " << units.size() << '\n';
+    }
+
+    static void Tags(std::ostream& out) {
+        std::shared_lock lock{Emerald::Storage::Lock};
+        auto tags = Emerald::Storage::CountTags();
+        for (auto& tag : tags)
+            out << tag.first << ' ' << tag.second << '\n';
+        out << "ok " << tags.size() << '\n';
+    }
+
+    static void Compile(const std::string& args, std::ostream& out) {
+        auto split = args.find(' ');
+        if (split == std::string::npos) {
+            out << "error usage: compile <output> <request> [-- <outer request>]\n";
+            return;
+        }
+
+        auto request = args.substr(split + 1);
+        std::istringstream outer;
+        auto separator = request.find(" -- ");
+        if (separator != std::string::npos) {
+            outer.str(request.substr(separator + 4));
+            request.resize(separator);
+        }
+
+        std::shared_lock lock{Emerald::Storage::Lock};
+        std::lock_guard compile{CompileLock_};
+
+        auto targets = std::move(Emerald::Compile::Targets);
+        auto output = Emerald::Compile::Output;
+
+        Emerald::Compile::Targets.clear();
+        try {
+            auto selected = Emerald::Compile::SelectInto(request, Emerald::Compile::Targets);
+            Emerald::Compile::SetOutputPath(args.substr(0, split));
+            Emerald::Compile::CompileTargets(nullptr, outer);
+            out << "ok " << selected << '\n';
+        } catch (...) {
+            Emerald::Compile::Targets = std::move(targets);
+            Emerald::Compile::Output = output;
+            throw;
+        }
+
+        Emerald::Compile::Targets = std::move(targets);
+        Emerald::Compile::Output = output;
+    }
+
+    static void Reload(const std::string& path, std::ostream& out) {
+        std::unique_lock lock{Emerald::Storage::Lock};
+        if (Emerald::Storage::ReloadUnit(path))
+            out << "ok 1\n";
+        else
+            out << "error unknown unit " << path << '\n';
+    }
+
+    static bool Handle(const std::string& line, std::ostream& out) {
+        auto split = line.find(' ');
+        auto command = line.substr(0, split);
+        auto args = split == std::string::npos ? std::string{} : line.substr(split + 1);
+
+        // A failed request is answered, it never takes the daemon down.
+        try {
+            if (command == "select")
+                Select(args, out);
+            else if (command == "tags")
+                Tags(out);
+            else if (command == "compile")
+                Compile(args, out);
+            else if (command == "reload")
+                Reload(args, out);
+            else if (command == "stop") {
+                out << "ok stopping\n";
+                return false;
+            } else
+                out << "error unknown command " << command << '\n';
+        } catch (const std::exception& e) {
+            out << "error " << e.what() << '\n';
+        }
+        return true;
+    }
+
+    static void Client(int fd) {
+        std::string buffer;
+        char chunk[4096];
+        bool serving = true;
+        ssize_t size;
+        while (serving && (size = ::recv(fd, chunk, sizeof(chunk), 0)) > 0) {
+            buffer.append(chunk, size);
+            size_t end;
+            while (serving && (end = buffer.find('\n')) != std::string::npos) {
+                std::stringstream out;
+                serving = Handle(buffer.substr(0, end), out);
+                buffer.erase(0, end + 1);
+
+                auto reply = out.str();
+                for (size_t sent = 0; sent < reply.size();) {
+                    auto r = ::send(fd, reply.data() + sent, reply.size() - sent, 0);
+                    if (r <= 0)
+                        break;
+                    sent += r;
+                }
+            }
+        }
+        if (!serving)
+            ::shutdown(Socket_, SHUT_RDWR);
+
+        std::lock_guard lock{ClientsLock_};
+        Clients_.erase(fd);
+        ::close(fd);
+        ClientsDone_.notify_all();
+    }
+
+public:
+    static void Serve(std::string path) {
+        std::signal(SIGPIPE, SIG_IGN);
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            std::cout << "Socket path too long: " << path << std::endl;
+            return;
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        ::unlink(path.c_str());
+
+        Socket_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (Socket_ == -1 || ::bind(Socket_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(Socket_, 64) != 0) {
+            std::cout << "Failed to listen on " << path << std::endl;
+            if (Socket_ != -1)
+                ::close(Socket_);
+            return;
+        }
+
+        std::cout << "Serving " << Emerald::Storage::Units.size() << " units on " << path << std::endl;
+        int fd;
+        while ((fd = ::accept(Socket_, nullptr, nullptr)) != -1) {
+            {
+                std::lock_guard lock{ClientsLock_};
+                Clients_.insert(fd);
+            }
+            std::thread{Client, fd}.detach();
+        }
+
+        // Idle clients see the end of their stream, busy ones still send
+        // the reply of the request they are handling.
+        std::unique_lock lock{ClientsLock_};
+        for (auto client : Clients_)
+            ::shutdown(client, SHUT_RD);
+        ClientsDone_.wait(lock, [] { return Clients_.empty(); });
+        ::close(Socket_);
+        ::unlink(path.c_str());
+        std::cout << "Daemon stopped" << std::endl;
+    }
+
+    static void SetupDaemonMappings(echolang::echo_mapping* mapping) {
+        mapping->mappings["Serve"] = echolang::echo_bind_function(Serve);
+    }
+};
+
 struct Emerald::EchoExtension {
     static void SetupEmeraldMappings(echolang::echo_mapping* mapping) {
         {
@@ -469,10 +2611,15 @@ struct Emerald::EchoExtension {
             Emerald::Storage::SetupStorageMappings(&storage);
             mapping->mappings["Storage"] = storage;
         }
+        {
+            echolang::echo_mapping daemon;
+            Emerald::Daemon::SetupDaemonMappings(&daemon);
+            mapping->mappings["Daemon"] = daemon;
+        }
     }
 };
 
-class RegexSelector : public InnerSelector {
+class RegexSelector final : public InnerSelector {
 private:
     std::regex Expr_;
 public:
@@ -491,15 +2638,23 @@ public:
     bool Satisfies(fs::directory_entry file) {
         if (!file.is_regular_file())
             return false;
-        return std::regex_match(file.path().filename().c_str(), Expr_);
+        return Matches(file.path().filename().string());
+    }
+
+    bool Matches(const std::string& filename) const {
+        return std::regex_match(filename, Expr_);
+    }
+
+    std::string Signature() const {
+        return "regex:" + Expression;
     }
 
-    static InnerSelector* CreateDefault() {
-        return new RegexSelector{};
+    static EmeraldStage<InnerSelector> CreateDefault() {
+        return EmeraldPool<RegexSelector>::Create<InnerSelector>();
     }
 };
 
-class DefaultSelector : public InnerSelector {
+class DefaultSelector final : public InnerSelector {
 public:
 
     void CompilationMsg(CompilationRound round, const EmeraldUnit& reffered) {}
@@ -509,15 +2664,27 @@ public:
     bool Satisfies(fs::directory_entry file) {
         if (!file.is_regular_file())
             return false;
-        return file.path().extension() != ".emerald";
+        return Matches(file.path().filename().string());
+    }
+
+    bool Matches(const std::string& filename) const {
+        return Extension(filename) != ".emerald";
+    }
+
+    // Same as fs::path::extension for a plain file name, without the path.
+    static std::string_view Extension(std::string_view filename) {
+        auto dot = filename.rfind('.');
+        if (dot == std::string_view::npos || dot == 0 || filename == "..")
+            return {};
+        return filename.substr(dot);
     }
 
-    static InnerSelector* CreateDefault() {
-        return new DefaultSelector{};
+    static EmeraldStage<InnerSelector> CreateDefault() {
+        return EmeraldShared<DefaultSelector>::Create<InnerSelector>();
     }
 };
 
-class FilenameSorter : public Sorter {
+class FilenameSorter final : public Sorter {
 public:
     void CompilationMsg(CompilationRound round, const EmeraldUnit& reffered) {}
 
@@ -527,12 +2694,12 @@ public:
         return a.filename() < b.filename();
     }
 
-    static Sorter* CreateDefault() {
-        return new FilenameSorter{};
+    static EmeraldStage<Sorter> CreateDefault() {
+        return EmeraldShared<FilenameSorter>::Create<Sorter>();
     }
 };
 
-class OuterSelectAll : public OuterSelector {
+class OuterSelectAll final : public OuterSelector {
 public:
     void CompilationMsg(CompilationRound round, const EmeraldUnit& reffered) {}
 
@@ -543,8 +2710,8 @@ public:
         return true;
     }
 
-    static OuterSelector* CreateDefault() {
-        return new OuterSelectAll{};
+    static EmeraldStage<OuterSelector> CreateDefault() {
+        return EmeraldShared<OuterSelectAll>::Create<OuterSelector>();
     }
 };
 
@@ -598,19 +2765,29 @@ public:
         return Checker.check(Request);
     }
 
-    static void TagRequest() {
-        std::cout << "Input tag request for outer selector:\n";
+    std::string Signature() const {
+        std::string res = "taged:";
+        for (auto& tag : Request)
+            res += tag + ' ';
+        for (auto& [tag, range] : Ranges)
+            res += '|' + tag + '=' + std::to_string(range.first) + ".." + std::to_string(range.second);
+        return res;
+    }
+
+    static void TagRequest(std::istream& input) {
+        if (&input == &std::cin)
+            std::cout << "Input tag request for outer selector:\n";
         std::string req;
-        std::getline(std::cin, req);
+        std::getline(input, req);
         Request = TagChecker::parse(req);
     }
 
-    static OuterSelector* CreateDefault() {
-        return new OuterSelectorTaged{};
+    static EmeraldStage<OuterSelector> CreateDefault() {
+        return EmeraldPool<OuterSelectorTaged>::Create<OuterSelector>();
     }
 };
 
-class ThroughNamer : public Namer {
+class ThroughNamer final : public Namer {
 private:
     inline static int Index_{0};
 
@@ -624,18 +2801,94 @@ public:
     }
 
     std::string MakeName(fs::path file, int index, const EmeraldUnit& src) {
-        return std::to_string(++Index_) + " [" + src.Name + "]" + file.extension().c_str();
+        std::string res;
+        AppendName(res, file.filename().string(), src);
+        return res;
+    }
+
+    void AppendName(std::string& out, const std::string& filename, const EmeraldUnit& src) {
+        char number[24];
+        auto end = std::to_chars(number, number + sizeof(number), ++Index_).ptr;
+        out.append(number, end);
+        out += " [";
+        // A separator in the unit name would turn the file name into a path.
+        auto name = out.size();
+        out += src.Name;
+        std::replace(out.begin() + name, out.end(), '/', '_');
+        out += ']';
+        out += DefaultSelector::Extension(filename);
     }
 
     static void UpdateIndexer() {
         Index_ = 0;
     }
 
-    static Namer* CreateDefault() {
-        return new ThroughNamer();
+    static EmeraldStage<Namer> CreateDefault() {
+        return EmeraldPool<ThroughNamer>::Create<Namer>();
     }
 };
 
+// Built-in sorter with a built-in selector: names are compared as strings and
+// the selector is called directly instead of through the stage interface.
+bool Emerald::Listings::ScanBuiltin_(const EmeraldUnit& unit, std::vector<File>& files) {
+    if (dynamic_cast<FilenameSorter*>(unit.FSorter.get()) == nullptr)
+        return false;
+
+    auto scan = [&](const auto& selector) {
+        for (auto& entry : fs::directory_iterator(unit.Path)) {
+            if (!entry.is_regular_file())
+                continue;
+            auto name = entry.path().filename().string();
+            if (selector.Matches(name))
+                files.push_back(File{std::move(name), entry.file_size()});
+        }
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.Name < b.Name; });
+    };
+
+    if (auto regex = dynamic_cast<RegexSelector*>(unit.FInSelector.get()))
+        scan(*regex);
+    else if (auto selector = dynamic_cast<DefaultSelector*>(unit.FInSelector.get()))
+        scan(*selector);
+    else
+        return false;
+    return true;
+}
+
+// OuterSelectAll skips the selection pass and ThroughNamer writes into one
+// reused buffer; other stages go through their virtual interface.
+template<typename Emit>
+void Emerald::Compile::NameFiles_(EmeraldUnit& unit, const std::vector<Emerald::Listings::File>& files, Emit emit) {
+    auto kernel = [&](auto accept, auto name) {
+        for (size_t index = 0; index < files.size(); index++) {
+            auto file = fs::path{unit.Path}/files[index].Name;
+            if (accept(file, index))
+                emit(file, index, name(file, index));
+        }
+    };
+
+    bool all = dynamic_cast<OuterSelectAll*>(unit.FOutSelector.get()) != nullptr;
+    auto through = dynamic_cast<ThroughNamer*>(unit.FNamer.get());
+    std::string buffer;
+
+    auto select_all = [](const fs::path& file, size_t index) { return true; };
+    auto select = [&](const fs::path& file, size_t index) { return unit.FOutSelector->Satisfies(file, index, unit); };
+    auto through_name = [&](const fs::path& file, size_t index) -> const std::string& {
+        buffer.clear();
+        through->AppendName(buffer, files[index].Name, unit);
+        return buffer;
+    };
+    auto make_name = [&](const fs::path& file, size_t index) { return unit.FNamer->MakeName(file, index, unit); };
+
+    if (all && through)
+        kernel(select_all, through_name);
+    else if (all)
+        kernel(select_all, make_name);
+    else if (through)
+        kernel(select, through_name);
+    else
+        kernel(select, make_name);
+}
+
 namespace {
     auto s0 = EmeraldInit<InnerSelector>("regex_selector", RegexSelector::CreateDefault);
     auto s1 = EmeraldInit<InnerSelector>("default", DefaultSelector::CreateDefault);
@@ -645,7 +2898,7 @@ namespace {
     auto s5 = EmeraldInit<Namer>{"through", ThroughNamer::CreateDefault};
 
     auto k1 = EmeraldStatic{ThroughNamer::UpdateIndexer};
-    auto k2 = EmeraldStatic{OuterSelectorTaged::TagRequest};
+    auto k2 = EmeraldStatic{std::function<void(std::istream&)>{OuterSelectorTaged::TagRequest}};
 }
 
 
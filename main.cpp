@@ -1,20 +1,59 @@
 #include "hdrs/emerald.hpp"
+#include <optional>
 
 int main(int argc, char* argv[]) {
+    if (argc > 2 && std::string{argv[1]} == "--compile") {
+        for (int i = 2; i < argc; i++) {
+            bool ok = echolang::echo_script::compile_file(argv[i]);
+            std::cout << (ok ? "Compiled: " : "Failed: ") << argv[i] << std::endl;
+        }
+        return 0;
+    }
+
+    bool profile = argc > 2 && std::string{argv[1]} == "--profile";
+    if (profile) {
+        argv++;
+        argc--;
+    }
+
+    bool stream = argc > 2 && std::string{argv[1]} == "--stream";
+    if (stream) {
+        argv++;
+    }
+
     auto mappings = echolang::echo_mapping::create_default_controls();
     Emerald::EchoExtension::SetupEmeraldMappings(&mappings);
+
     std::cout << "Compile path:\n";
     std::string path{argv[1]};
     std::cout << path << std::endl;
     //std::getline(std::cin, path);
 
-    auto script = std::make_shared<echolang::echo_script>();
-    script->from_file(path);
+    echolang::echo_profiler profiler;
+    std::optional<echolang::echo_profiler::scope> profiling;
+    if (profile)
+        profiling.emplace(profiler);
+
+    if (stream) {
+        echolang::echo_stream source{path};
+        echolang::executor exec{nullptr, mappings};
+        exec.run(source);
+    } else {
+        auto script = std::make_shared<echolang::echo_script>();
+        script->from_file(path);
+
+        std::cout << *script;
 
-    std::cout << *script;
+        echolang::executor exec{script, mappings};
 
-    echolang::executor exec{script, mappings};
+        exec.run();
+    }
 
-    exec.run();
+    if (profile) {
+        profiler.report(std::cout);
+        std::ofstream folded{path + ".folded"};
+        profiler.folded(folded);
+        std::cout << "Folded stacks: " << path + ".folded" << std::endl;
+    }
 }
 